@@ -0,0 +1,330 @@
+/*******************************************************************************
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Library General Public
+ License version 2 as published by the Free Software Foundation.
+ .
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Library General Public License for more details.
+ .
+ You should have received a copy of the GNU Library General Public License
+ along with this library; see the file COPYING.LIB.  If not, write to
+ the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ Boston, MA 02110-1301, USA.
+*******************************************************************************/
+
+#include "inoframe.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <poll.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#define FRAME_START '('
+#define FRAME_END ')'
+
+#define FRAME_SEPARATOR ':'
+#define FRAME_TAG '#'
+
+static int nameCode(const char *const *table, int size, const char *name, size_t len)
+{
+    for (int i = 0; i < size; i++)
+    {
+        if (strlen(table[i]) == len && strncmp(table[i], name, len) == 0)
+            return i;
+    }
+    return -1;
+}
+
+bool inoParseFrame(const char *text, size_t len, InoFrame *frame, const char **error)
+{
+    const char *problem = nullptr;
+    const char *end;
+    const char *cmd;
+    const char *cmdEnd;
+    const char *target;
+    const char *value;
+    int code;
+
+    frame->sequence = -1;
+    // Before any pointer into the text is formed, the last character of an empty one is not in it
+    if (len < 2)
+    {
+        if (error != nullptr)
+            *error = "no start or end token";
+        return false;
+    }
+    end = text + len - 1;
+    cmd = text + 1;
+    if (text[0] != FRAME_START || *end != FRAME_END)
+        problem = "no start or end token";
+    else if (std::find_if(text, end, [](char c) { return c < ' ' || c > '~'; }) != end)
+        problem = "unprintable character";
+    else
+    {
+        cmdEnd = cmd;
+        while (cmdEnd < end && *cmdEnd != FRAME_SEPARATOR && *cmdEnd != FRAME_TAG)
+            cmdEnd++;
+        code = nameCode(inoCommandNames, INO_COMMANDS, cmd, cmdEnd - cmd);
+        if (code <= INO_CMD_NONE)
+            problem = "unknown command";
+        else
+        {
+            frame->command = (InoCommand)code;
+            target = cmdEnd;
+            if (*target == FRAME_TAG)
+            {
+                frame->sequence = 0;
+                for (target++; target < end && *target >= '0' && *target <= '9' && frame->sequence <= 255; target++)
+                    frame->sequence = frame->sequence * 10 + (*target - '0');
+                if (target == cmdEnd + 1 || frame->sequence > 255)
+                    problem = "bad sequence id";
+            }
+        }
+        if (problem == nullptr && (target == end || *target != FRAME_SEPARATOR))
+            problem = "no target";
+    }
+    if (problem == nullptr)
+    {
+        target++;
+        value = (const char *)memchr(target, FRAME_SEPARATOR, end - target);
+        if (value == nullptr)
+            problem = "no value";
+        else if (value == target || value - target > INO_MAX_NAME)
+            problem = "bad target";
+        else if (value + 1 == end)
+            problem = "empty value";
+        else if (memchr(value, FRAME_START, end - value) != nullptr || memchr(value, FRAME_END, end - value) != nullptr)
+            problem = "token inside value";
+    }
+    if (problem != nullptr)
+    {
+        if (error != nullptr)
+            *error = problem;
+        return false;
+    }
+
+    frame->targetText = { target, (size_t)(value - target) };
+    frame->target = (InoTarget)nameCode(inoTargetNames, INO_TARGETS, target, value - target);
+    frame->value = { value + 1, (size_t)(end - value - 1) };
+    return true;
+}
+
+unsigned char inoCrc8(const unsigned char *data, int len)
+{
+    unsigned char crc = 0;
+    for (int i = 0; i < len; i++)
+    {
+        crc ^= data[i];
+        for (int bit = 0; bit < 8; bit++)
+            crc = (crc & 0x80) ? (unsigned char)((crc << 1) ^ 0x07) : (unsigned char)(crc << 1);
+    }
+    return crc;
+}
+
+int inoEncodeBinary(const char *text, unsigned char *frame, size_t frameSize)
+{
+    InoFrame parsed;
+    const char *value;
+    size_t valueLen;
+    size_t len;
+    char onOff;
+
+    if (!inoParseFrame(text, strlen(text), &parsed) || parsed.target == INO_TARGET_OTHER)
+        return 0;
+
+    // ON and OFF shrink to a byte, the usual "0" placeholder to nothing
+    value = parsed.value.data;
+    valueLen = parsed.value.len;
+    if (parsed.value.is("ON") || parsed.value.is("OFF"))
+    {
+        onOff = (valueLen == 2) ? 1 : 0;
+        value = &onOff;
+        valueLen = 1;
+    }
+    else if (parsed.value.is("0"))
+        valueLen = 0;
+    len = INO_BIN_HEADER + valueLen;
+    if (len > 255 || len + INO_BIN_OVERHEAD > frameSize)
+        return 0;
+
+    frame[0] = INO_BIN_SYNC;
+    frame[1] = len;
+    frame[2] = parsed.command;
+    frame[3] = parsed.target;
+    frame[4] = (parsed.sequence < 0) ? 0 : parsed.sequence;
+    memcpy(frame + 5, value, valueLen);
+    frame[len + 2] = inoCrc8(frame + 1, len + 1);
+    return len + INO_BIN_OVERHEAD;
+}
+
+bool inoDecodeBinary(const unsigned char *body, int len, char *text, size_t textSize)
+{
+    const char *value = "0";
+    char valueText[256];
+    int valueLen = len - INO_BIN_HEADER;
+    int written;
+
+    if (valueLen < 0 || body[0] == 0 || body[0] >= INO_COMMANDS || body[1] >= INO_TARGETS)
+        return false;
+    if (valueLen == 1 && body[3] <= 1)
+        value = (body[3] == 1) ? "ON" : "OFF";
+    else if (valueLen > 0)
+    {
+        memcpy(valueText, body + 3, valueLen);
+        valueText[valueLen] = '\0';
+        value = valueText;
+    }
+    written = snprintf(text, textSize, "(%s#%d:%s:%s)", inoCommandNames[body[0]], body[2], inoTargetNames[body[1]], value);
+    return written > 0 && (size_t)written < textSize;
+}
+
+int InoFrameBuffer::fill(int fd, int timeoutMs)
+{
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    int status = poll(&pfd, 1, timeoutMs);
+    calls++;
+    if (status <= 0)
+        return status;
+
+    // Nothing can be framed from a full buffer without an end token, resync by dropping it
+    if (count == CAPACITY)
+        clear();
+
+    // Free space may wrap around the end of the ring, read both pieces in one call
+    int tail = (head + count) % CAPACITY;
+    int space = CAPACITY - count;
+    struct iovec iov[2];
+    int iovcnt = 1;
+    iov[0].iov_base = ring + tail;
+    if (tail + space <= CAPACITY)
+        iov[0].iov_len = space;
+    else
+    {
+        iov[0].iov_len = CAPACITY - tail;
+        iov[1].iov_base = ring;
+        iov[1].iov_len = space - (CAPACITY - tail);
+        iovcnt = 2;
+    }
+
+    ssize_t n = readv(fd, iov, iovcnt);
+    calls++;
+    if (n == 0)
+    {
+        errno = EPIPE;
+        return -1;
+    }
+    if (n < 0)
+        return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+    count += n;
+    received += n;
+    return n;
+}
+
+bool InoFrameBuffer::nextFrame(char *frame, size_t frameSize)
+{
+    while (count > 0)
+    {
+        // Discard anything ahead of a start token, the line end the sketch sends after a frame is not a resync
+        int start = 0;
+        bool noise = false;
+        while (start < count && at(start) != FRAME_START)
+        {
+            noise = noise || (at(start) != '\r' && at(start) != '\n');
+            start++;
+        }
+        if (noise)
+            dropped++;
+        consume(start);
+        if (count == 0)
+            return false;
+
+        // A second start token before the end means the earlier frame was cut short, resync on it
+        int end = 1;
+        while (end < count && at(end) != FRAME_END && at(end) != FRAME_START)
+            end++;
+        if (end == count)
+            return false; // Partial frame, wait for more input
+        if (at(end) == FRAME_START)
+        {
+            dropped++;
+            consume(end);
+            continue;
+        }
+
+        int len = end + 1;
+        if ((size_t)len >= frameSize)
+        {
+            dropped++;
+            consume(len); // Too long to be a valid frame
+            continue;
+        }
+        for (int i = 0; i < len; i++)
+            frame[i] = at(i);
+        frame[len] = '\0';
+        consume(len);
+        return true;
+    }
+    return false;
+}
+
+bool InoFrameBuffer::nextBinaryFrame(unsigned char *body, size_t bodySize, int *len)
+{
+    while (count > 0)
+    {
+        // Discard anything ahead of a sync byte
+        int start = 0;
+        while (start < count && (unsigned char)at(start) != INO_BIN_SYNC)
+            start++;
+        if (start > 0)
+            dropped++;
+        consume(start);
+        if (count < 2)
+            return false;
+
+        int bodyLen = (unsigned char)at(1);
+        if (bodyLen < INO_BIN_HEADER || (size_t)bodyLen > bodySize)
+        {
+            dropped++;
+            consume(1); // Not a real sync byte
+            continue;
+        }
+        if (count < bodyLen + INO_BIN_OVERHEAD)
+            return false; // Partial frame, wait for more input
+
+        unsigned char frame[256 + INO_BIN_OVERHEAD];
+        for (int i = 0; i < bodyLen + INO_BIN_OVERHEAD; i++)
+            frame[i] = at(i);
+        if (inoCrc8(frame + 1, bodyLen + 1) != frame[bodyLen + 2])
+        {
+            badCrc++;
+            dropped++;
+            consume(1); // Corrupted, resync on the next sync byte
+            continue;
+        }
+        memcpy(body, frame + 2, bodyLen);
+        *len = bodyLen;
+        consume(bodyLen + INO_BIN_OVERHEAD);
+        return true;
+    }
+    return false;
+}
+
+void InoFrameBuffer::clear()
+{
+    head = 0;
+    count = 0;
+}
+
+void InoFrameBuffer::consume(int n)
+{
+    head = (head + n) % CAPACITY;
+    count -= n;
+    if (count == 0)
+        head = 0;
+}
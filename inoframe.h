@@ -0,0 +1,138 @@
+/*******************************************************************************
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Library General Public
+ License version 2 as published by the Free Software Foundation.
+ .
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Library General Public License for more details.
+ .
+ You should have received a copy of the GNU Library General Public License
+ along with this library; see the file COPYING.LIB.  If not, write to
+ the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ Boston, MA 02110-1301, USA.
+*******************************************************************************/
+
+#pragma once
+
+#include <cstddef>
+#include <cstring>
+
+/*
+ * Commands and targets of the protocol. The order is the binary code of each, both ends must
+ * agree on it so new names are only ever added at the end.
+ */
+enum InoCommand { INO_CMD_NONE, INO_CMD_CON, INO_CMD_GET, INO_CMD_SET, INO_CMD_ACK, INO_CMD_NAK, INO_CMD_EVT, INO_COMMANDS };
+enum InoTarget
+{
+    INO_TARGET_OTHER = -1, // Not one of the names below, only its text is available
+    INO_TARGET_NONE,       // "0"
+    INO_TARGET_OPENED,
+    INO_TARGET_CLOSED,
+    INO_TARGET_RAPARK,
+    INO_TARGET_DECPARK,
+    INO_TARGET_ALL,
+    INO_TARGET_OPEN,
+    INO_TARGET_CLOSE,
+    INO_TARGET_EVENTS,
+    INO_TARGET_BINARY,
+    INO_TARGET_SEQ,
+    INO_TARGET_ERROR,
+    INO_TARGET_BAUD,
+    INO_TARGET_READY,      // (EVT:READY:version) sent by the controller once it has started
+    INO_TARGET_EDGES,      // Milliseconds since each switch changed
+    INO_TARGET_ABORT,      // Stop the roof if it is still moving
+    INO_TARGETS
+};
+
+static constexpr const char *inoCommandNames[INO_COMMANDS] = { "", "CON", "GET", "SET", "ACK", "NAK", "EVT" };
+static constexpr const char *inoTargetNames[INO_TARGETS] = { "0", "OPENED", "CLOSED", "RAPARK", "DECPARK", "ALL",
+                                                             "OPEN", "CLOSE", "EVENTS", "BINARY", "SEQ", "ERROR", "BAUD", "READY", "EDGES", "ABORT" };
+
+// Part of a frame, it is not terminated
+struct InoText
+{
+    const char *data;
+    size_t len;
+
+    bool is(const char *text) const { return strlen(text) == len && strncmp(data, text, len) == 0; }
+};
+
+// A "(CMD[#seq]:TARGET:VALUE)" frame split into its parts, which point into the frame text
+struct InoFrame
+{
+    InoCommand command;
+    InoTarget target;
+    int sequence;   // -1 when untagged
+    InoText targetText;
+    InoText value;  // Anything up to the end token, NAK values contain ':'
+};
+
+#define INO_MAX_NAME 15 // Longest command or target
+
+// Split the len characters of text into frame, nothing is copied or modified and text need not be
+// terminated. Returns false for a malformed frame with error set to what is wrong with it.
+bool inoParseFrame(const char *text, size_t len, InoFrame *frame, const char **error = nullptr);
+
+/*
+ * Binary framing, negotiated with (SET:BINARY:ON)
+ *   SYNC LEN CMD TARGET SEQ [VALUE...] CRC
+ * LEN counts CMD through the end of VALUE. CRC is a CRC-8 (polynomial 0x07) over LEN through VALUE.
+ * CMD and TARGET are the InoCommand and InoTarget codes above, SEQ is the request sequence id.
+ * VALUE ON and OFF are sent as the single bytes 1 and 0, an empty VALUE is "0", anything else
+ * is the value text.
+ */
+#define INO_BIN_SYNC 0xA5
+#define INO_BIN_HEADER 3   // CMD TARGET SEQ
+#define INO_BIN_OVERHEAD 3 // SYNC LEN CRC
+
+unsigned char inoCrc8(const unsigned char *data, int len);
+
+// Convert between the text form "(CMD#seq:TARGET:VALUE)" and a complete binary frame.
+// Encoding returns the frame length and decoding true, or 0 and false when the frame cannot be represented.
+int inoEncodeBinary(const char *text, unsigned char *frame, size_t frameSize);
+bool inoDecodeBinary(const unsigned char *body, int len, char *text, size_t textSize);
+
+/*
+ * Receive ring buffer for the controller link.
+ * fill() drains everything the port has available with a single read, nextFrame() hands back
+ * complete "(...)" frames and nextBinaryFrame() complete binary frames. Bytes outside a frame
+ * are dropped, a partial frame stays buffered until the rest of it arrives.
+ */
+class InoFrameBuffer
+{
+  public:
+    static const int CAPACITY = 512;
+
+    // Wait up to timeoutMs for input then read all that is available.
+    // Returns bytes read, 0 on timeout, -1 on error or end of file with errno set.
+    int fill(int fd, int timeoutMs);
+
+    // Copy the next complete frame including its parentheses into frame as a C string.
+    // Returns false if no complete frame is buffered.
+    bool nextFrame(char *frame, size_t frameSize);
+
+    // Copy the body, CMD through VALUE, of the next binary frame that passes its CRC.
+    // Returns false if no complete frame is buffered.
+    bool nextBinaryFrame(unsigned char *body, size_t bodySize, int *len);
+
+    void clear();
+    int pending() const { return count; }
+    unsigned long crcErrors() const { return badCrc; }
+    unsigned long resyncs() const { return dropped; }
+    unsigned long bytesIn() const { return received; }
+    unsigned long systemCalls() const { return calls; }
+
+  private:
+    char at(int offset) const { return ring[(head + offset) % CAPACITY]; }
+    void consume(int n);
+
+    char ring[CAPACITY];
+    int head { 0 };
+    int count { 0 };
+    unsigned long badCrc { 0 };
+    unsigned long dropped { 0 };    // Times input was discarded to find the start of the next frame
+    unsigned long received { 0 };
+    unsigned long calls { 0 };  // poll and read
+};
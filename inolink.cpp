@@ -0,0 +1,420 @@
+/*******************************************************************************
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Library General Public
+ License version 2 as published by the Free Software Foundation.
+ .
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Library General Public License for more details.
+ .
+ You should have received a copy of the GNU Library General Public License
+ along with this library; see the file COPYING.LIB.  If not, write to
+ the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ Boston, MA 02110-1301, USA.
+*******************************************************************************/
+
+#include "inolink.h"
+#include "indicom.h"
+#include "indilogger.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+void InoLink::setDeviceName(const char *name)
+{
+    strncpy(deviceName, name, sizeof(deviceName) - 1);
+}
+
+void InoLink::setEventHandler(EventHandler *handler, void *context)
+{
+    eventHandler = handler;
+    eventContext = context;
+}
+
+void InoLink::setPort(int fd)
+{
+    portFD = fd;
+    reset();
+    frames.clear();
+}
+
+/*
+ * A new session starts untagged and in text, with nothing outstanding
+ */
+void InoLink::reset()
+{
+    sequenced = false;
+    binaryFraming = false;
+    for (int i = 0; i < MAXINOFLIGHT; i++)
+        requests[i].inUse = false;
+}
+
+bool InoLink::isEvent(const char *frame)
+{
+    return strncmp(frame, "(EVT", 4) == 0 && (frame[4] == ':' || frame[4] == '#');
+}
+
+InoLink::Stats InoLink::stats() const
+{
+    Stats current = counters;
+    current.bytesIn = frames.bytesIn();
+    current.systemCalls += frames.systemCalls();
+    current.malformed += frames.crcErrors();
+    current.resyncs = frames.resyncs();
+    return current;
+}
+
+void InoLatency::record(long microseconds)
+{
+    int bucket = (int)std::max(microseconds, 0L);
+
+    if (microseconds >= 4)
+    {
+        int msb = 63 - __builtin_clzl(microseconds);
+        bucket = 4 * (msb - 1) + (int)((microseconds >> (msb - 2)) & 3);
+    }
+    counts[std::min(bucket, INO_LATENCY_BUCKETS - 1)]++;
+    total++;
+}
+
+double InoLatency::percentile(double p) const
+{
+    unsigned long rank = (unsigned long)std::ceil(p * total);
+    unsigned long seen = 0;
+
+    for (int bucket = 0; bucket < INO_LATENCY_BUCKETS && total > 0; bucket++)
+    {
+        seen += counts[bucket];
+        if (seen < std::max(rank, 1UL))
+            continue;
+        if (bucket < 4)
+            return bucket / 1000.0;
+        // Middle of the bucket
+        int shift = bucket / 4 - 1;
+        return ((4 + bucket % 4) * 2 + 1) * (1L << shift) / 2000.0;
+    }
+    return 0;
+}
+
+/*
+ * Controller input waiting outside of a request is passed to the event handler if it is an
+ * event, or to the outstanding request it answers. Anything else is stale and dropped.
+ */
+bool InoLink::drain()
+{
+    char frame[MAXINOBUF];
+
+    if (frames.fill(portFD, 0) < 0)
+    {
+        communicationErrors++;
+        return false;
+    }
+    while (nextFrame(frame))
+    {
+        if (isEvent(frame))
+        {
+            if (eventHandler != nullptr)
+                eventHandler(frame, eventContext);
+        }
+        else
+            matchResponse(frame);
+    }
+    return true;
+}
+
+/*
+ * Send (cmd:target:value) to the controller without waiting for the response. Up to MAXINOFLIGHT
+ * requests can be outstanding. Returns the sequence id to collect the response with using
+ * await(), or -1 if the request could not be sent.
+ */
+int InoLink::send(const char *cmd, const char *target, const char *value)
+{
+    char writeBuffer[MAXINOBUF];
+    InoRequest *request = nullptr;
+    int sequence = nextSequence;
+    int outstanding = 0;
+
+    for (int i = 0; i < MAXINOFLIGHT; i++)
+    {
+        if (requests[i].inUse)
+            outstanding++;
+        else if (request == nullptr)
+            request = &requests[i];
+    }
+    if (request == nullptr)
+    {
+        LOG_ERROR("Too many requests outstanding to the roof controller");
+        return -1;
+    }
+
+    if (sequenced)
+        snprintf(writeBuffer, sizeof(writeBuffer), "(%s#%d:%s:%s)", cmd, sequence, target, value);
+    else
+        snprintf(writeBuffer, sizeof(writeBuffer), "(%s:%s:%s)", cmd, target, value);
+    if (!write(writeBuffer, outstanding == 0))
+        return -1;
+
+    nextSequence = (nextSequence + 1) % 256;
+    counters.requests++;
+    request->latencyType = LATENCY_TYPES;
+    for (int type = LATENCY_CON; type < LATENCY_TYPES; type++)
+    {
+        if (strcmp(cmd, inoCommandNames[INO_CMD_CON + type]) == 0)
+            request->latencyType = type;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &request->sent);
+    request->inUse = true;
+    request->answered = false;
+    request->sequence = sequence;
+    request->order = requestOrder++;
+    return sequence;
+}
+
+/*
+ * Collect the response to the request sent with sequence id. Responses to other outstanding
+ * requests that arrive first are held until asked for. Without sequence ids responses are
+ * matched to requests in the order they were sent.
+ */
+bool InoLink::await(int sequence, char *response, int timeoutMs)
+{
+    char readBuffer[MAXINOBUF];
+    InoRequest *request = findRequest(sequence);
+
+    if (request == nullptr)
+        return false;
+
+    while (!request->answered)
+    {
+        memset(readBuffer, 0, sizeof(readBuffer));
+        if (!readFrame(readBuffer, timeoutMs))
+        {
+            request->inUse = false;
+            return false;
+        }
+        matchResponse(readBuffer);
+    }
+    strcpy(response, request->response);
+    request->inUse = false;
+    counters.transactions++;
+    return true;
+}
+
+bool InoLink::request(const char *cmd, const char *target, const char *value, char *response)
+{
+    int sequence = send(cmd, target, value);
+    return (sequence >= 0) && await(sequence, response);
+}
+
+bool InoLink::collect(int sequence, char *response)
+{
+    InoRequest *request = findRequest(sequence);
+
+    if (request == nullptr || !request->answered)
+        return false;
+    strcpy(response, request->response);
+    request->inUse = false;
+    counters.transactions++;
+    communicationErrors = 0;
+    return true;
+}
+
+void InoLink::abandon(int sequence)
+{
+    InoRequest *request = findRequest(sequence);
+
+    if (request == nullptr)
+        return;
+    LOG_DEBUG("Roof control connection error: Timeout error");
+    request->inUse = false;
+    communicationErrors++;
+    counters.timeouts++;
+}
+
+InoLink::InoRequest *InoLink::findRequest(int sequence)
+{
+    for (int i = 0; i < MAXINOFLIGHT; i++)
+    {
+        if (requests[i].inUse && requests[i].sequence == sequence)
+            return &requests[i];
+    }
+    return nullptr;
+}
+
+/*
+ * Hand a response frame to the outstanding request it answers. (ACK#nn:...) and (NAK#nn:...)
+ * carry the sequence id, an untagged frame answers the oldest request.
+ */
+void InoLink::matchResponse(const char *frame)
+{
+    InoRequest *request = nullptr;
+    InoFrame parsed;
+    bool valid = inoParseFrame(frame, strlen(frame), &parsed);
+    bool tagged = valid && parsed.sequence >= 0;
+    int sequence = parsed.sequence;
+    struct timespec now;
+
+    if (!valid)
+        counters.malformed++;
+    else if (parsed.command == INO_CMD_NAK)
+        counters.naks++;
+
+    for (int i = 0; i < MAXINOFLIGHT; i++)
+    {
+        InoRequest *candidate = &requests[i];
+        if (!candidate->inUse || candidate->answered)
+            continue;
+        if (tagged ? (candidate->sequence == sequence) : (request == nullptr || candidate->order < request->order))
+            request = candidate;
+    }
+    if (request == nullptr)
+    {
+        LOGF_DEBUG("Discarding unmatched frame from roof controller: %s", frame);
+        return;
+    }
+    strcpy(request->response, frame);
+    request->answered = true;
+    if (request->latencyType < LATENCY_TYPES)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        counters.latency[request->latencyType].record((now.tv_sec - request->sent.tv_sec) * 1000000L +
+                                                      (now.tv_nsec - request->sent.tv_nsec) / 1000);
+    }
+}
+
+bool InoLink::awaitEvent(InoTarget target, char *frame, int timeoutMs)
+{
+    struct timespec start, now;
+    InoFrame parsed;
+    int waited = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (true)
+    {
+        while (nextFrame(frame))
+        {
+            if (!isEvent(frame))
+                LOGF_DEBUG("Discarding frame from roof controller: %s", frame);
+            else if (inoParseFrame(frame, strlen(frame), &parsed) && parsed.target == target)
+                return true;
+            else if (eventHandler != nullptr)
+                eventHandler(frame, eventContext);
+        }
+        if (waited >= timeoutMs || frames.fill(portFD, timeoutMs - waited) < 0)
+            return false;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        waited = (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+    }
+}
+
+/*
+ * Return the next complete frame from the controller in retBuf, sized MAXINOBUF.
+ * Input is drained into the receive buffer a read at a time, waiting at most timeoutMs
+ * overall for the frame to complete.
+ */
+bool InoLink::readFrame(char *retBuf, int timeoutMs)
+{
+    struct timespec start, now;
+    int status;
+    int waited;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (true)
+    {
+        // Events may arrive ahead of the response being waited on
+        if (nextFrame(retBuf))
+        {
+            if (!isEvent(retBuf))
+                break;
+            if (eventHandler != nullptr)
+                eventHandler(retBuf, eventContext);
+            continue;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        waited = (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+        if (waited >= timeoutMs)
+        {
+            LOG_DEBUG("Roof control connection error: Timeout error");
+            communicationErrors++;
+            counters.timeouts++;
+            return false;
+        }
+        status = frames.fill(portFD, timeoutMs - waited);
+        if (status < 0)
+        {
+            LOGF_DEBUG("Roof control connection error: %s", strerror(errno));
+            communicationErrors++;
+            return false;
+        }
+        if (status > 0)
+            communicationErrors = 0;
+    }
+    return true;
+}
+
+/*
+ * Take the next complete frame from the receive buffer as text, sized MAXINOBUF.
+ * Binary frames that fail their CRC are dropped by the receive buffer.
+ */
+bool InoLink::nextFrame(char *frame)
+{
+    unsigned char body[MAXINOBUF];
+    int len;
+
+    if (!binaryFraming)
+        return frames.nextFrame(frame, MAXINOBUF);
+    while (frames.nextBinaryFrame(body, sizeof(body), &len))
+    {
+        if (inoDecodeBinary(body, len, frame, MAXINOBUF))
+            return true;
+        LOG_DEBUG("Discarding unknown binary frame from roof controller");
+        counters.malformed++;
+    }
+    return false;
+}
+
+bool InoLink::write(const char *msg, bool discardStale)
+{
+    int retMsgLen = 0;
+    int status;
+    char errMsg[MAXINOERR];
+
+    if (strlen(msg) >= MAXINOLINE)
+    {
+        LOG_ERROR("Roof controller command message too long");
+        return false;
+    }
+    LOGF_DEBUG("Sent to roof controller: %s", msg);
+    // Without sequence ids anything still waiting when nothing is outstanding is either an event
+    // or a stale response to an earlier request that would otherwise be taken for the response to this one
+    if (discardStale && !sequenced)
+        drain();
+    if (binaryFraming)
+    {
+        unsigned char frame[MAXINOBUF];
+        int frameLen = inoEncodeBinary(msg, frame, sizeof(frame));
+        if (frameLen == 0)
+        {
+            LOGF_ERROR("Roof controller command has no binary form: %s", msg);
+            return false;
+        }
+        status = tty_write(portFD, (const char *)frame, frameLen, &retMsgLen);
+    }
+    else
+        status = tty_write_string(portFD, msg, &retMsgLen);
+    counters.systemCalls++;
+    counters.bytesOut += retMsgLen;
+    if (status != TTY_OK)
+    {
+        tty_error_msg(status, errMsg, MAXINOERR);
+        LOGF_DEBUG("roof control connection error: %s", errMsg);
+        communicationErrors++;
+        return false;
+    }
+    return true;
+}
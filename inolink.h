@@ -0,0 +1,138 @@
+/*******************************************************************************
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Library General Public
+ License version 2 as published by the Free Software Foundation.
+ .
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Library General Public License for more details.
+ .
+ You should have received a copy of the GNU Library General Public License
+ along with this library; see the file COPYING.LIB.  If not, write to
+ the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ Boston, MA 02110-1301, USA.
+*******************************************************************************/
+
+#pragma once
+
+#include "inoframe.h"
+
+#include <ctime>
+
+// Arduino controller interface limits
+#define MAXINOLINE 63   // Sized to contain outgoing command requests
+#define MAXINOBUF 255   // Sized for maximum overall input / output
+#define MAXINOERR 255   // System call error message buffer
+#define MAXINOWAIT 2    // seconds
+#define MAXINOFLIGHT 3  // Requests outstanding at once, limited by the 64 byte receive buffer on the Nano
+#define INO_LATENCY_BUCKETS 96
+
+/*
+ * Round trip times counted in buckets, four to each doubling from 1 us up to 16 s, so recording
+ * is a single increment and percentiles are within about 12% of the true value.
+ */
+struct InoLatency
+{
+    unsigned int counts[INO_LATENCY_BUCKETS];
+    unsigned long total;
+
+    void record(long microseconds);
+    // Milliseconds, 0 when nothing has been recorded
+    double percentile(double p) const;
+};
+
+/*
+ * Request and response exchange with the roof controller over an open serial port.
+ * Requests are (cmd:target:value) text, sent as text or binary frames depending on what was
+ * negotiated. Event frames arriving at any time are passed to the event handler.
+ */
+class InoLink
+{
+  public:
+    typedef void (EventHandler)(const char *frame, void *context);
+
+    // Latency is kept for the requests the driver sends
+    enum { LATENCY_CON, LATENCY_GET, LATENCY_SET, LATENCY_TYPES };
+
+    // Counters for measuring the link
+    struct Stats
+    {
+        unsigned long requests;
+        unsigned long transactions;  // Requests answered
+        unsigned long timeouts;
+        unsigned long naks;
+        unsigned long malformed;     // Frames that could not be parsed, including binary CRC failures
+        unsigned long resyncs;       // Input discarded to find the next frame
+        unsigned long bytesOut;
+        unsigned long bytesIn;
+        unsigned long systemCalls;
+        InoLatency latency[LATENCY_TYPES];
+    };
+
+    void setDeviceName(const char *name);
+    const char *getDeviceName() const { return deviceName; }
+    void setEventHandler(EventHandler *handler, void *context);
+
+    // Use fd for the link, starting a new session of untagged text requests
+    void setPort(int fd);
+    int getPort() const { return portFD; }
+    void reset();
+    void clear() { frames.clear(); }
+
+    void setSequenced(bool enable) { sequenced = enable; }
+    bool isSequenced() const { return sequenced; }
+    void setBinaryFraming(bool enable) { binaryFraming = enable; }
+    bool isBinaryFraming() const { return binaryFraming; }
+
+    // Send a request without waiting, returns its sequence id for await() or -1 on failure
+    int send(const char *cmd, const char *target, const char *value);
+    // Collect the response to a sent request in response, sized MAXINOBUF
+    bool await(int sequence, char *response, int timeoutMs = MAXINOWAIT * 1000);
+    bool request(const char *cmd, const char *target, const char *value, char *response);
+    // Without waiting: take the response if drain() has matched it, or give up on the request
+    bool collect(int sequence, char *response);
+    void abandon(int sequence);
+    // Read whatever is waiting without blocking and dispatch it
+    bool drain();
+    // Wait for an event about target, returned in frame sized MAXINOBUF. Other events are
+    // dispatched, anything else is dropped.
+    bool awaitEvent(InoTarget target, char *frame, int timeoutMs);
+
+    static bool isEvent(const char *frame);
+
+    unsigned int errors() const { return communicationErrors; }
+    void clearErrors() { communicationErrors = 0; }
+    Stats stats() const;
+
+  private:
+    struct InoRequest
+    {
+        bool inUse;
+        bool answered;
+        int sequence;
+        unsigned int order;
+        int latencyType;            // LATENCY_TYPES when not measured
+        struct timespec sent;
+        char response[MAXINOBUF];
+    };
+
+    bool readFrame(char *frame, int timeoutMs);
+    bool nextFrame(char *frame);
+    bool write(const char *msg, bool discardStale);
+    void matchResponse(const char *frame);
+    InoRequest *findRequest(int sequence);
+
+    char deviceName[64] {};
+    int portFD { -1 };
+    EventHandler *eventHandler { nullptr };
+    void *eventContext { nullptr };
+    InoFrameBuffer frames;          // Input from the controller not yet consumed
+    InoRequest requests[MAXINOFLIGHT] {};
+    bool sequenced { false };       // Controller echoes the request sequence id as (ACK#nn:target:value)
+    bool binaryFraming { false };   // Frames are exchanged in the binary form with a CRC, see inoframe.h
+    int nextSequence { 0 };
+    unsigned int requestOrder { 0 };
+    unsigned int communicationErrors { 0 };
+    Stats counters {};
+};
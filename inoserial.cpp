@@ -0,0 +1,86 @@
+/*******************************************************************************
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Library General Public
+ License version 2 as published by the Free Software Foundation.
+ .
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Library General Public License for more details.
+ .
+ You should have received a copy of the GNU Library General Public License
+ along with this library; see the file COPYING.LIB.  If not, write to
+ the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ Boston, MA 02110-1301, USA.
+*******************************************************************************/
+
+#include "inoserial.h"
+
+#ifdef __linux__
+// termios2 takes the rate as a number, it cannot be mixed with <termios.h> in the same file
+#include <asm/termbits.h>
+#include <sys/ioctl.h>
+
+bool inoSetBaudRate(int fd, int baud)
+{
+    struct termios2 tio;
+
+    if (ioctl(fd, TCGETS2, &tio) < 0)
+        return false;
+    tio.c_cflag &= ~(CBAUD | (CBAUD << IBSHIFT));
+    tio.c_cflag |= BOTHER | (BOTHER << IBSHIFT);
+    tio.c_ispeed = baud;
+    tio.c_ospeed = baud;
+    return ioctl(fd, TCSETS2, &tio) == 0;
+}
+
+int inoGetBaudRate(int fd)
+{
+    struct termios2 tio;
+
+    if (ioctl(fd, TCGETS2, &tio) < 0)
+        return 0;
+    return tio.c_ospeed;
+}
+
+bool inoSetHangup(int fd, bool hangup)
+{
+    struct termios2 tio;
+
+    if (ioctl(fd, TCGETS2, &tio) < 0)
+        return false;
+    tio.c_cflag = hangup ? (tio.c_cflag | HUPCL) : (tio.c_cflag & ~HUPCL);
+    return ioctl(fd, TCSETS2, &tio) == 0;
+}
+
+#else
+#include <termios.h>
+
+bool inoSetBaudRate(int fd, int baud)
+{
+    struct termios tio;
+
+    if (tcgetattr(fd, &tio) < 0 || cfsetspeed(&tio, baud) < 0)
+        return false;
+    return tcsetattr(fd, TCSADRAIN, &tio) == 0;
+}
+
+int inoGetBaudRate(int fd)
+{
+    struct termios tio;
+
+    if (tcgetattr(fd, &tio) < 0)
+        return 0;
+    return cfgetospeed(&tio);
+}
+
+bool inoSetHangup(int fd, bool hangup)
+{
+    struct termios tio;
+
+    if (tcgetattr(fd, &tio) < 0)
+        return false;
+    tio.c_cflag = hangup ? (tio.c_cflag | HUPCL) : (tio.c_cflag & ~HUPCL);
+    return tcsetattr(fd, TCSADRAIN, &tio) == 0;
+}
+#endif
@@ -0,0 +1,32 @@
+/*******************************************************************************
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Library General Public
+ License version 2 as published by the Free Software Foundation.
+ .
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Library General Public License for more details.
+ .
+ You should have received a copy of the GNU Library General Public License
+ along with this library; see the file COPYING.LIB.  If not, write to
+ the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ Boston, MA 02110-1301, USA.
+*******************************************************************************/
+
+#pragma once
+
+/*
+ * Serial port line speed for the controller link. Any rate can be set, not only the standard
+ * termios ones, so 250000 baud that a 16 MHz Nano generates exactly is available.
+ * Return false, or 0 for the rate, if the port could not be queried or changed.
+ */
+bool inoSetBaudRate(int fd, int baud);
+int inoGetBaudRate(int fd);
+
+/*
+ * Whether DTR drops when the port is closed. Opening the port raises DTR, and an Arduino resets
+ * when DTR goes from low to high. With hangup off, DTR stays up after the port is closed, so the
+ * next open does not reset the board.
+ */
+bool inoSetHangup(int fd, bool hangup);
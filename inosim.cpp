@@ -0,0 +1,209 @@
+/*******************************************************************************
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Library General Public
+ License version 2 as published by the Free Software Foundation.
+ .
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Library General Public License for more details.
+ .
+ You should have received a copy of the GNU Library General Public License
+ along with this library; see the file COPYING.LIB.  If not, write to
+ the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ Boston, MA 02110-1301, USA.
+*******************************************************************************/
+
+
+#include "inosim.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
+void InoSim::setTimeScale(double timeScale)
+{
+    double time = seconds();
+
+    clock_gettime(CLOCK_MONOTONIC, &realBase);
+    virtualBase = time;
+    scale = std::max(timeScale, 1.0);
+}
+
+void InoSim::setFault(int fault, bool on)
+{
+    if (fault == FAULT_STUCK_SWITCH && on && !faults[fault])
+    {
+        advance(seconds());
+        stuckOpened = isOpened();
+        stuckClosed = isClosed();
+    }
+    faults[fault] = on;
+}
+
+// A move in progress carries on at the new speed from where it has got to
+void InoSim::setTravel(double travelTime)
+{
+    advance(seconds());
+    travel = std::max(travelTime, 0.1);
+}
+
+void InoSim::now(struct timespec *time) const
+{
+    double virtualTime = seconds();
+
+    time->tv_sec = (time_t)virtualTime;
+    time->tv_nsec = (long)((virtualTime - time->tv_sec) * 1e9);
+}
+
+int InoSim::realDelay(double virtualMs) const
+{
+    return (int)std::ceil(std::max(virtualMs, 0.0) / scale);
+}
+
+bool InoSim::contact()
+{
+    advance(seconds());
+    pending.clear();
+    return !faults[FAULT_DROP_RESPONSE];
+}
+
+/*
+ * Answer every request of the job now, from the roof as it is, to be handed back once the link
+ * would have carried the answers. Dropped requests come back unanswered after the link's timeout.
+ */
+bool InoSim::post(const InoJob &job)
+{
+    Pending answered {};
+    double wait = faults[FAULT_SLOW_LINK] ? SIM_SLOW_LINK : SIM_RESPONSE;
+    double time = seconds();
+
+    advance(time);
+    answered.result.tag = job.tag;
+    answered.result.count = job.count;
+    for (int i = 0; i < job.count; i++)
+    {
+        const char *cmd = job.requests[i].cmd;
+        int type = !strcmp(cmd, "GET") ? InoLink::LATENCY_GET : InoLink::LATENCY_SET;
+
+        counters.requests++;
+        if (faults[FAULT_DROP_RESPONSE])
+        {
+            counters.timeouts++;
+            wait = MAXINOWAIT * 1000;
+            continue;
+        }
+        answer(cmd, job.requests[i].target, job.requests[i].value, answered.result.responses[i]);
+        answered.result.ok[i] = true;
+        counters.transactions++;
+        counters.latency[type].record((long)(wait * 1000));
+    }
+    // The link answers in order, a result is not due before one posted earlier
+    answered.due = time + wait / 1000;
+    if (!pending.empty())
+        answered.due = std::max(answered.due, pending.back().due);
+    pending.push_back(answered);
+    return true;
+}
+
+bool InoSim::next(InoResult *result)
+{
+    if (pending.empty() || pending.front().due > seconds())
+        return false;
+    *result = pending.front().result;
+    result->errors = 0;
+    result->stats = counters;
+    pending.erase(pending.begin());
+    return true;
+}
+
+int InoSim::untilNext() const
+{
+    if (pending.empty())
+        return -1;
+    return realDelay((pending.front().due - seconds()) * 1000);
+}
+
+// Virtual seconds now
+double InoSim::seconds() const
+{
+    struct timespec real;
+
+    clock_gettime(CLOCK_MONOTONIC, &real);
+    return virtualBase + ((real.tv_sec - realBase.tv_sec) + (real.tv_nsec - realBase.tv_nsec) / 1e9) * scale;
+}
+
+// Move the roof on to where it is at time, it stops once it reaches either end
+void InoSim::advance(double time)
+{
+    position += direction * (time - movedAt) / travel;
+    if (position >= 1 || position <= 0)
+    {
+        position = std::min(std::max(position, 0.0), 1.0);
+        direction = 0;
+    }
+    movedAt = time;
+}
+
+bool InoSim::isOpened() const
+{
+    if (faults[FAULT_BOTH_SWITCHES])
+        return true;
+    return faults[FAULT_STUCK_SWITCH] ? stuckOpened : position >= 1;
+}
+
+bool InoSim::isClosed() const
+{
+    if (faults[FAULT_BOTH_SWITCHES])
+        return true;
+    return faults[FAULT_STUCK_SWITCH] ? stuckClosed : position <= 0;
+}
+
+/*
+ * The response the controller would send, in the text form without sequence ids. Requests the
+ * controller does not have are rejected as it would reject them.
+ */
+void InoSim::answer(const char *cmd, const char *target, const char *value, char *response)
+{
+    const char *error = nullptr;
+    char state[8];
+
+    if (!strcmp(cmd, "GET"))
+    {
+        if (!strcmp(target, "ALL"))
+            snprintf(state, sizeof(state), "%c%c00", isOpened() ? '1' : '0', isClosed() ? '1' : '0');
+        else if (!strcmp(target, "OPENED"))
+            snprintf(state, sizeof(state), "%s", isOpened() ? "ON" : "OFF");
+        else if (!strcmp(target, "CLOSED"))
+            snprintf(state, sizeof(state), "%s", isClosed() ? "ON" : "OFF");
+        else
+            error = "Request not implemented in controller";
+    }
+    else if (!strcmp(cmd, "SET"))
+    {
+        snprintf(state, sizeof(state), "%s", value);
+        if (faults[FAULT_NAK])
+            error = "Relay busy with previous command, command ignored";
+        else if (!strcmp(target, "ABORT") && direction == 0)
+            error = "Abort command ignored, roof already stationary";
+        else if (!strcmp(target, "ABORT"))
+            direction = 0;
+        else if (!strcmp(target, "OPEN"))
+            direction = (position < 1) ? 1 : 0;
+        else if (!strcmp(target, "CLOSE"))
+            direction = (position > 0) ? -1 : 0;
+        else
+            error = "Request not implemented in controller";
+    }
+    else
+        error = "Command must map to either set a relay or get a switch";
+
+    if (error != nullptr)
+    {
+        counters.naks++;
+        snprintf(response, MAXINOBUF, "(NAK:ERROR:%s:%s)", value, error);
+    }
+    else
+        snprintf(response, MAXINOBUF, "(ACK:%s:%s)", target, state);
+}
@@ -0,0 +1,94 @@
+/*******************************************************************************
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Library General Public
+ License version 2 as published by the Free Software Foundation.
+ .
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Library General Public License for more details.
+ .
+ You should have received a copy of the GNU Library General Public License
+ along with this library; see the file COPYING.LIB.  If not, write to
+ the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ Boston, MA 02110-1301, USA.
+*******************************************************************************/
+
+
+#pragma once
+
+#include "inoworker.h"
+
+#include <ctime>
+#include <vector>
+
+#define SIM_TRAVEL 10        // Seconds the simulated roof takes to travel between its limit switches, unless set
+#define SIM_RESPONSE 20      // Milliseconds the simulated controller takes to answer a job
+#define SIM_SLOW_LINK 1500   // Milliseconds it takes with FAULT_SLOW_LINK
+
+/*
+ * Stands in for the roof controller in simulation mode. Jobs posted to it are answered as the
+ * controller would answer them, from a roof that moves on a virtual clock running a chosen number
+ * of times faster than real time, so that a move and its timeout take a fraction of their usual
+ * time. Results are collected with next() once due, as they are from InoWorker.
+ *
+ * Faults can be injected to take the driver down its failure paths:
+ *   FAULT_STUCK_SWITCH   the limit switches keep the states they had when the fault was set
+ *   FAULT_BOTH_SWITCHES  the opened and closed switches both read on
+ *   FAULT_DROP_RESPONSE  nothing is answered, each request times out after MAXINOWAIT
+ *   FAULT_NAK            commands are rejected, requests for the switches are still answered
+ *   FAULT_SLOW_LINK      answers take SIM_SLOW_LINK rather than SIM_RESPONSE
+ */
+class InoSim
+{
+  public:
+    enum Fault { FAULT_STUCK_SWITCH, FAULT_BOTH_SWITCHES, FAULT_DROP_RESPONSE, FAULT_NAK, FAULT_SLOW_LINK, FAULTS };
+
+    // Virtual seconds to each real one, the virtual clock carries on from where it is
+    void setTimeScale(double timeScale);
+    double timeScale() const { return scale; }
+    void setFault(int fault, bool on);
+    void setTravel(double travelTime);
+    bool hasFault(int fault) const { return faults[fault]; }
+
+    // Virtual time, the same as CLOCK_MONOTONIC until the scale is changed
+    void now(struct timespec *time) const;
+    // Real milliseconds until virtualMs of virtual time has passed
+    int realDelay(double virtualMs) const;
+
+    // Whether the controller answers the handshake
+    bool contact();
+    bool post(const InoJob &job);
+    bool next(InoResult *result);
+    // Real milliseconds until the next result is due, -1 with none waiting
+    int untilNext() const;
+    // Drop the results waiting, as when the link is stopped
+    void clear() { pending.clear(); }
+    const InoLink::Stats &stats() const { return counters; }
+
+  private:
+    struct Pending
+    {
+        double due;             // Virtual seconds
+        InoResult result;
+    };
+
+    double seconds() const;
+    void advance(double time);
+    bool isOpened() const;
+    bool isClosed() const;
+    void answer(const char *cmd, const char *target, const char *value, char *response);
+
+    double scale { 1 };
+    struct timespec realBase { 0, 0 };  // Real time the virtual clock was last rebased at
+    double virtualBase { 0 };           // Virtual seconds at realBase
+    bool faults[FAULTS] {};
+    bool stuckOpened { false };
+    bool stuckClosed { true };
+    double travel { SIM_TRAVEL };
+    double position { 0 };              // 0 closed to 1 opened
+    int direction { 0 };                // 1 opening, -1 closing, 0 stationary
+    double movedAt { 0 };               // Virtual seconds position was last brought up to date
+    std::vector<Pending> pending;       // In order of posting, due times only increase
+    InoLink::Stats counters {};
+};
@@ -0,0 +1,387 @@
+/*******************************************************************************
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Library General Public
+ License version 2 as published by the Free Software Foundation.
+ .
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Library General Public License for more details.
+ .
+ You should have received a copy of the GNU Library General Public License
+ along with this library; see the file COPYING.LIB.  If not, write to
+ the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ Boston, MA 02110-1301, USA.
+*******************************************************************************/
+
+
+#include "inoworker.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#define REACTOR_IDLE_WAIT 1000  // Milliseconds between checks for stopping when nothing happens
+#define REACTOR_EVENTS 16       // Ports handled per wait
+#define BACKLOG_RETRY 10        // Milliseconds between offers of kept back results to a full queue
+
+static void wake(int fd)
+{
+    char c = 0;
+    while (write(fd, &c, 1) < 0 && errno == EINTR)
+        ;
+}
+
+static void drainPipe(int fd)
+{
+    char buffer[64];
+    while (read(fd, buffer, sizeof(buffer)) > 0)
+        ;
+}
+
+static bool openPipe(int fds[2])
+{
+    if (pipe(fds) < 0)
+        return false;
+    for (int i = 0; i < 2; i++)
+        fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+    return true;
+}
+
+static void closePipe(int fds[2])
+{
+    for (int i = 0; i < 2; i++)
+    {
+        if (fds[i] >= 0)
+            close(fds[i]);
+        fds[i] = -1;
+    }
+}
+
+static int msUntil(const struct timespec &when, const struct timespec &now)
+{
+    long ms = (when.tv_sec - now.tv_sec) * 1000 + (when.tv_nsec - now.tv_nsec) / 1000000;
+    return (int)std::max(ms, 0L);
+}
+
+// Never destroyed, workers may still be stopping as the process exits
+InoReactor &InoReactor::instance()
+{
+    static InoReactor *reactor = new InoReactor();
+    return *reactor;
+}
+
+bool InoReactor::add(InoWorker *worker)
+{
+    std::lock_guard<std::mutex> guard(lock);
+
+    if (!running)
+    {
+        struct epoll_event event {};
+        epollFD = epoll_create1(0);
+        if (epollFD < 0 || !openPipe(wakePipe))
+        {
+            if (epollFD >= 0)
+                close(epollFD);
+            epollFD = -1;
+            return false;
+        }
+        event.events = EPOLLIN;
+        event.data.ptr = nullptr;
+        epoll_ctl(epollFD, EPOLL_CTL_ADD, wakePipe[0], &event);
+        running = true;
+        thread = std::thread(&InoReactor::run, this);
+    }
+    workers.push_back(worker);
+    watch(worker, true);
+    return true;
+}
+
+void InoReactor::remove(InoWorker *worker)
+{
+    bool last;
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (!contains(worker))
+            return;
+        watch(worker, false);
+        workers.erase(std::find(workers.begin(), workers.end(), worker));
+        last = workers.empty();
+        if (last)
+            running = false;
+    }
+    if (!last)
+        return;
+    wake();
+    thread.join();
+    close(epollFD);
+    epollFD = -1;
+    closePipe(wakePipe);
+}
+
+void InoReactor::wake()
+{
+    if (wakePipe[1] >= 0)
+        ::wake(wakePipe[1]);
+}
+
+bool InoReactor::contains(InoWorker *worker) const
+{
+    return std::find(workers.begin(), workers.end(), worker) != workers.end();
+}
+
+void InoReactor::watch(InoWorker *worker, bool enable)
+{
+    struct epoll_event event {};
+
+    if (worker->watched == enable)
+        return;
+    event.events = EPOLLIN;
+    event.data.ptr = worker;
+    epoll_ctl(epollFD, enable ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, worker->link->getPort(), &event);
+    worker->watched = enable;
+}
+
+/*
+ * Start and finish jobs on every link, then wait for input on any port or the nearest request
+ * to run out of time. Controller input outside of a request can only be events.
+ */
+void InoReactor::run()
+{
+    struct epoll_event events[REACTOR_EVENTS];
+    struct timespec now;
+    int ready = 0;
+
+    while (running)
+    {
+        int wait = REACTOR_IDLE_WAIT;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            for (int i = 0; i < ready; i++)
+            {
+                InoWorker *worker = static_cast<InoWorker *>(events[i].data.ptr);
+                if (worker == nullptr)
+                    drainPipe(wakePipe[0]);
+                else if (contains(worker) && !worker->portReady())
+                    watch(worker, false); // Rather than spin on the error, left until its next job
+            }
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            for (InoWorker *worker : workers)
+            {
+                int due = worker->service(now);
+                if (worker->isBusy())
+                    watch(worker, true);
+                if (due >= 0)
+                    wait = std::min(wait, due);
+            }
+        }
+        ready = epoll_wait(epollFD, events, REACTOR_EVENTS, wait);
+        if (ready < 0)
+            ready = 0;
+    }
+}
+
+bool InoWorker::start(InoLink *inoLink)
+{
+    if (isRunning())
+        return true;
+    if (!openPipe(notifyPipe))
+        return false;
+    link = inoLink;
+    link->setEventHandler(eventHelper, this);
+    for (Lane &lane : lanes)
+        lane.busy = false;
+    watched = false;
+    started = true;
+    if (!InoReactor::instance().add(this))
+    {
+        started = false;
+        closePipe(notifyPipe);
+        return false;
+    }
+    return true;
+}
+
+void InoWorker::stop()
+{
+    if (!isRunning())
+        return;
+    started = false;
+    InoReactor::instance().remove(this);
+    link->setEventHandler(nullptr, nullptr);
+
+    // Anything still queued or in progress is dropped with the session
+    InoJob job;
+    InoResult result;
+    for (Lane &lane : lanes)
+    {
+        while (lane.jobs.pop(job))
+            ;
+        if (lane.busy)
+            abandon(lane);
+    }
+    while (results.pop(result))
+        ;
+    backlog.clear();
+    backlogged = false;
+    closePipe(notifyPipe);
+}
+
+bool InoWorker::addRequest(InoJob *job, const char *cmd, const char *target, const char *value)
+{
+    if (job->count >= INO_JOB_REQUESTS)
+        return false;
+    snprintf(job->requests[job->count].cmd, sizeof(job->requests[0].cmd), "%s", cmd);
+    snprintf(job->requests[job->count].target, sizeof(job->requests[0].target), "%s", target);
+    snprintf(job->requests[job->count].value, sizeof(job->requests[0].value), "%s", value);
+    job->count++;
+    return true;
+}
+
+bool InoWorker::post(const InoJob &job, bool urgent)
+{
+    if (!isRunning() || !lanes[urgent ? LANE_URGENT : LANE_ROUTINE].jobs.push(job))
+        return false;
+    InoReactor::instance().wake();
+    return true;
+}
+
+bool InoWorker::next(InoResult *result)
+{
+    drainPipe(notifyPipe[0]);
+    if (!results.pop(*result))
+        return false;
+    // Room for a result kept back, rather than leave it until the reactor next looks
+    if (backlogged)
+        InoReactor::instance().wake();
+    return true;
+}
+
+/*
+ * Run the jobs of both lanes, urgent first so a command to the roof is written ahead of a poll
+ * starting at the same time. Returns milliseconds until a job in progress runs out of time or a
+ * result kept back is offered again, or -1 with nothing waiting.
+ */
+int InoWorker::service(const struct timespec &now)
+{
+    flushBacklog();
+    int urgent = service(lanes[LANE_URGENT], now);
+    int routine = service(lanes[LANE_ROUTINE], now);
+    int due = (urgent < 0 || routine < 0) ? std::max(urgent, routine) : std::min(urgent, routine);
+
+    if (backlogged)
+        due = (due < 0) ? BACKLOG_RETRY : std::min(due, BACKLOG_RETRY);
+    return due;
+}
+
+/*
+ * Collect the responses the lane's job in progress has had, giving up on the rest after MAXINOWAIT,
+ * and start its next job once it is done.
+ */
+int InoWorker::service(Lane &lane, const struct timespec &now)
+{
+    while (true)
+    {
+        InoJob job;
+        InoResult &current = lane.current;
+
+        if (!lane.busy)
+        {
+            if (!lane.jobs.pop(job))
+                return -1;
+            lane.busy = true;
+            current.tag = job.tag;
+            current.count = job.count;
+            for (int i = 0; i < job.count; i++)
+            {
+                current.responses[i][0] = '\0';
+                lane.sequence[i] = link->send(job.requests[i].cmd, job.requests[i].target, job.requests[i].value);
+                current.ok[i] = false;
+                lane.collected[i] = (lane.sequence[i] < 0);
+            }
+            lane.deadline = now;
+            lane.deadline.tv_sec += MAXINOWAIT;
+        }
+
+        bool done = true;
+        for (int i = 0; i < current.count; i++)
+        {
+            if (!lane.collected[i])
+                lane.collected[i] = current.ok[i] = link->collect(lane.sequence[i], current.responses[i]);
+            done = done && lane.collected[i];
+        }
+        if (!done && msUntil(lane.deadline, now) > 0)
+            return msUntil(lane.deadline, now);
+        abandon(lane);
+        deliver(current);
+    }
+}
+
+// Give up on the responses still awaited by the lane's job
+void InoWorker::abandon(Lane &lane)
+{
+    for (int i = 0; i < lane.current.count; i++)
+    {
+        if (!lane.collected[i])
+            link->abandon(lane.sequence[i]);
+    }
+    lane.busy = false;
+}
+
+// Returns false if the port could not be read
+bool InoWorker::portReady()
+{
+    return link->drain();
+}
+
+/*
+ * Never wait here for room in the queue. The reactor holds its lock, and the event loop that empties
+ * the queue may itself be waiting on that lock to add or remove another roof. A result the queue
+ * cannot take is kept back and offered again on the next pass, beyond INO_BACKLOG_SIZE it is dropped.
+ */
+void InoWorker::deliver(const InoResult &result)
+{
+    InoResult copy = result;
+    copy.errors = link->errors();
+    copy.stats = link->stats();
+    flushBacklog();
+    if (backlog.empty() && results.push(copy))
+        wake(notifyPipe[1]);
+    else if (backlog.size() < INO_BACKLOG_SIZE)
+        backlog.push_back(copy);
+    else
+        droppedResults++;
+    backlogged = !backlog.empty();
+}
+
+// Offer the results kept back to the queue again, in the order they came
+void InoWorker::flushBacklog()
+{
+    bool delivered = false;
+
+    while (!backlog.empty() && results.push(backlog.front()))
+    {
+        backlog.pop_front();
+        delivered = true;
+    }
+    backlogged = !backlog.empty();
+    if (delivered)
+        wake(notifyPipe[1]);
+}
+
+void InoWorker::eventHelper(const char *frame, void *context)
+{
+    InoWorker *worker = static_cast<InoWorker *>(context);
+    InoResult result;
+
+    result.tag = INO_RESULT_EVENT;
+    result.count = 1;
+    result.ok[0] = true;
+    snprintf(result.responses[0], MAXINOBUF, "%s", frame);
+    worker->deliver(result);
+}
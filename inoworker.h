@@ -0,0 +1,179 @@
+/*******************************************************************************
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Library General Public
+ License version 2 as published by the Free Software Foundation.
+ .
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Library General Public License for more details.
+ .
+ You should have received a copy of the GNU Library General Public License
+ along with this library; see the file COPYING.LIB.  If not, write to
+ the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ Boston, MA 02110-1301, USA.
+*******************************************************************************/
+
+
+#pragma once
+
+#include "inolink.h"
+
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#define INO_JOB_REQUESTS 2      // Requests sent together in one job
+#define INO_QUEUE_SIZE 16       // Jobs or results waiting in each queue
+#define INO_BACKLOG_SIZE 16     // Results kept back while the result queue is full, any more are dropped
+#define INO_RESULT_EVENT -1     // Tag of a result carrying an event frame from the controller
+
+/*
+ * Fixed size queue for one producer thread and one consumer thread, without locks.
+ */
+template <typename T, int N> class InoQueue
+{
+  public:
+    bool push(const T &item)
+    {
+        unsigned int tail = back.load(std::memory_order_relaxed);
+        if (tail - front.load(std::memory_order_acquire) == N)
+            return false;
+        slots[tail % N] = item;
+        back.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool pop(T &item)
+    {
+        unsigned int head = front.load(std::memory_order_relaxed);
+        if (head == back.load(std::memory_order_acquire))
+            return false;
+        item = slots[head % N];
+        front.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+  private:
+    T slots[N];
+    std::atomic<unsigned int> front { 0 };
+    std::atomic<unsigned int> back { 0 };
+};
+
+// Requests the worker sends together, awaiting all the responses
+struct InoJob
+{
+    int tag;        // Chosen by the poster to recognise the result
+    int count;
+    struct
+    {
+        char cmd[8];
+        char target[16];
+        char value[32];
+    } requests[INO_JOB_REQUESTS];
+};
+
+struct InoResult
+{
+    int tag;                    // Tag of the job, or INO_RESULT_EVENT
+    int count;
+    bool ok[INO_JOB_REQUESTS];  // Response received for each request
+    char responses[INO_JOB_REQUESTS][MAXINOBUF];
+    unsigned int errors;        // Link errors at the time
+    InoLink::Stats stats;       // Link counters at the time
+};
+
+class InoWorker;
+
+/*
+ * A single thread serving the controller links of every roof in the process. It waits on all
+ * their ports at once with epoll and runs each link's jobs without waiting on the others, so
+ * one slow or silent controller does not hold up the rest. Workers join it as their roofs
+ * connect and it stops when the last one leaves. Only used from the INDI event loop.
+ */
+class InoReactor
+{
+  public:
+    static InoReactor &instance();
+
+    bool add(InoWorker *worker);
+    void remove(InoWorker *worker);
+    void wake();
+
+  private:
+    InoReactor() = default;
+    void run();
+    bool contains(InoWorker *worker) const;
+    void watch(InoWorker *worker, bool enable);
+
+    std::mutex lock;                // Guards workers, the thread holds it except while waiting
+    std::vector<InoWorker *> workers;
+    std::thread thread;
+    std::atomic<bool> running { false };
+    int epollFD { -1 };
+    int wakePipe[2] { -1, -1 };     // Jobs posted or workers changed
+};
+
+/*
+ * The controller link of one roof, run by the reactor so the INDI event loop is never held up
+ * by the serial line. The event loop posts jobs and is woken through notifyFD() to collect
+ * results. Urgent jobs such as commands to the roof go ahead of any routine status polls
+ * waiting, and are sent without waiting for the responses to a poll already sent. Jobs in each
+ * lane run one at a time. Events from the controller come back as results. Once started the
+ * link must only be used through the worker until it is stopped.
+ */
+class InoWorker
+{
+  public:
+    ~InoWorker() { stop(); }
+
+    bool start(InoLink *link);
+    void stop();
+    bool isRunning() const { return started; }
+
+    // Add a request to a job, returns false if the job is full
+    static bool addRequest(InoJob *job, const char *cmd, const char *target, const char *value);
+
+    bool post(const InoJob &job, bool urgent);
+    bool next(InoResult *result);
+    int notifyFD() const { return notifyPipe[0]; }
+    // Results lost as neither the queue nor the backlog had room for them
+    unsigned long dropped() const { return droppedResults; }
+
+  private:
+    friend class InoReactor;
+
+    // Jobs waiting and the one in progress, the job is owned by the reactor thread
+    struct Lane
+    {
+        InoQueue<InoJob, INO_QUEUE_SIZE> jobs;
+        bool busy { false };
+        InoResult current;
+        int sequence[INO_JOB_REQUESTS];
+        bool collected[INO_JOB_REQUESTS];
+        struct timespec deadline;
+    };
+    enum { LANE_URGENT, LANE_ROUTINE, LANES };
+
+    // On the reactor thread
+    int service(const struct timespec &now);
+    int service(Lane &lane, const struct timespec &now);
+    void abandon(Lane &lane);
+    bool isBusy() const { return lanes[LANE_URGENT].busy || lanes[LANE_ROUTINE].busy; }
+    bool portReady();
+    void deliver(const InoResult &result);
+    void flushBacklog();
+    static void eventHelper(const char *frame, void *context);
+
+    InoLink *link { nullptr };
+    std::atomic<bool> started { false };
+    Lane lanes[LANES];
+    InoQueue<InoResult, INO_QUEUE_SIZE> results;
+    std::deque<InoResult> backlog;  // Results the queue had no room for, owned by the reactor thread
+    std::atomic<bool> backlogged { false };
+    std::atomic<unsigned long> droppedResults { 0 };
+    int notifyPipe[2] { -1, -1 };   // Results ready
+    bool watched { false };         // Port is in the reactor's epoll set, owned by the reactor thread
+};
@@ -9,9 +9,17 @@
  * tg November 2021 Break out commandReceived and requestReceived to make alernate actions more 
  *                  obvious/accessible, Remove Due specific code.
  * gt Sept 30 2024  Forked code to create rolloff-nano)
+ *
+ * The loop never waits. Each pass collects whatever serial input has arrived, advances any relay
+ * pulse in progress and settles any switch changes, so a pass takes well under a millisecond apart
+ * from sending a reply. A relay pulse runs in the background and its command is acknowledged
+ * as soon as it starts. Worst case latency from the last byte of a command to its reply being
+ * queued is one pass plus the reply for any command ahead of it, about 5 ms at 38400 baud.
  */
 
-#define BAUD_RATE 38400
+#define BAUD_RATE 38400           // Rate at start up, the host can move to a faster one with (SET:BAUD:rate)
+#define BAUD_TRIAL_MILLI 1000     // Milliseconds to hear a valid command at a new rate before returning to the old one
+#define BAUD_IDLE_MILLI 30000     // Milliseconds without a valid command before a faster rate returns to BAUD_RATE
 
 # define OPEN_CONTACT HIGH    // Switch definition, Change to LOW if pull-down resistors are used.
 
@@ -21,7 +29,9 @@
 #define SWITCH_3 4
 #define SWITCH_4 5
 
-#define ROOFRELAY 0
+#ifndef ROOFRELAY
+#define ROOFRELAY 0           // Not assigned, the host emulator gives it a pin
+#endif
 
 
 // Indirection to define a functional name in terms of a switch
@@ -34,6 +44,7 @@
 // Indirection to define a functional name in terms of a relay
 #define FUNC_OPEN  ROOFRELAY
 #define FUNC_CLOSE ROOFRELAY
+#define FUNC_STOP  ROOFRELAY
 /*
  * For the relay that the function is mapped to indicate if that relay is to be momentarily closed 
  * or held in a closed position. 
@@ -48,11 +59,15 @@
 */
 #define FUNC_OPEN_HOLD 0
 #define FUNC_CLOSE_HOLD 0
+#define FUNC_STOP_HOLD 0
 
 #define RELAY_PRIOR_DELAY 50
 #define RELAY_ON_DELAY 500
 #define RELAY_POST_DELAY 50
 
+#define INPUT_TIMEOUT 2000        // Milliseconds allowed to complete a command once it has started arriving
+#define SWITCH_DEBOUNCE_MILLI 30  // Milliseconds a switch must be steady before a change is accepted
+
 /*
  * Abort (stop) request is only meaningful if roof is in motion.
  *
@@ -62,6 +77,10 @@
  *
  * In case the end of run switches are not reached, some way to know if it is moving
  * would be helpful. Short of that estimate how long it takes the roof to open or close
+ *
+ * The stop pulse skips RELAY_PRIOR_DELAY and starts in the pass the request is read, so the relay
+ * changes within a millisecond of the request arriving. If the pulse that set the roof moving is
+ * still in progress the stop follows it, at most RELAY_ON_DELAY + RELAY_POST_DELAY later.
  */
 #define ROOF_OPEN_MILLI 15000       
 
@@ -70,6 +89,18 @@
 #define MAX_RESPONSE 127
 #define MAX_MESSAGE 63
 
+/*
+ * Binary framing, enabled by the host with (SET:BINARY:ON)
+ *   SYNC LEN CMD TARGET SEQ [VALUE...] CRC
+ * LEN counts CMD through the end of VALUE, CRC is a CRC-8 (polynomial 0x07) over LEN through VALUE.
+ * CMD and TARGET are the position of the name in binCommands and binTargets, these must match
+ * the tables in the driver. VALUE ON and OFF are the single bytes 1 and 0, an empty VALUE is "0".
+ * Replies go back in the same form as the request, a text request is always accepted.
+ */
+#define BIN_SYNC 0xA5
+#define BIN_HEADER 3
+#define BIN_OVERHEAD 3
+
 enum cmd_input {
 CMD_NONE,  
 CMD_OPEN,
@@ -77,180 +108,665 @@ CMD_CLOSE,
 CMD_STOP
 } command_input;
 
-unsigned long timeMove = 0;
+unsigned long timeMove = 0;      // When the roof was last set moving by command_input
+
+// Relay pulse in progress, advanced by runRelay() on each pass of the loop
+enum relay_state {
+RELAY_IDLE,
+RELAY_PRIOR,      // Released, waiting RELAY_PRIOR_DELAY before activating
+RELAY_ON,         // Activated, waiting RELAY_ON_DELAY before releasing
+RELAY_POST        // Released, waiting RELAY_POST_DELAY before accepting another command
+} relayState = RELAY_IDLE;
+int relayPin = 0;
+int relayHold = 0;
+unsigned long relayTime = 0;
+unsigned long relayPrior = RELAY_PRIOR_DELAY;
+bool stopPending = false;         // Stop pulse to follow the one in progress
+
+// Command input collected so far
+char inpBuf[MAX_INPUT+1];
+int inpCount = 0;
+unsigned char binBuf[MAX_INPUT+1];
+int binCount = 0;
+bool binaryMode = false;        // Host asked for binary frames, used for events
+bool binaryRequest = false;     // Request being answered arrived as a binary frame
+// Names of the binary codes and switch events, kept in flash along with the tables of them.
+// Read with strcmp_P(), strcpy_P() and pgm_read_ptr(), as the ERRORn messages are.
+const char NAME_NONE[] PROGMEM = "";
+const char NAME_CON[] PROGMEM = "CON";
+const char NAME_GET[] PROGMEM = "GET";
+const char NAME_SET[] PROGMEM = "SET";
+const char NAME_ACK[] PROGMEM = "ACK";
+const char NAME_NAK[] PROGMEM = "NAK";
+const char NAME_EVT[] PROGMEM = "EVT";
+const char NAME_0[] PROGMEM = "0";
+const char NAME_OPENED[] PROGMEM = "OPENED";
+const char NAME_CLOSED[] PROGMEM = "CLOSED";
+const char NAME_RAPARK[] PROGMEM = "RAPARK";
+const char NAME_DECPARK[] PROGMEM = "DECPARK";
+const char NAME_ALL[] PROGMEM = "ALL";
+const char NAME_OPEN[] PROGMEM = "OPEN";
+const char NAME_CLOSE[] PROGMEM = "CLOSE";
+const char NAME_EVENTS[] PROGMEM = "EVENTS";
+const char NAME_BINARY[] PROGMEM = "BINARY";
+const char NAME_SEQ[] PROGMEM = "SEQ";
+const char NAME_ERROR[] PROGMEM = "ERROR";
+const char NAME_BAUD[] PROGMEM = "BAUD";
+const char NAME_READY[] PROGMEM = "READY";
+const char NAME_EDGES[] PROGMEM = "EDGES";
+const char NAME_ABORT[] PROGMEM = "ABORT";
+const char* const binCommands[] PROGMEM = {NAME_NONE, NAME_CON, NAME_GET, NAME_SET, NAME_ACK, NAME_NAK, NAME_EVT};
+const char* const binTargets[] PROGMEM = {NAME_0, NAME_OPENED, NAME_CLOSED, NAME_RAPARK, NAME_DECPARK, NAME_ALL, NAME_OPEN, NAME_CLOSE, NAME_EVENTS, NAME_BINARY, NAME_SEQ, NAME_ERROR, NAME_BAUD, NAME_READY, NAME_EDGES, NAME_ABORT};
+const int binCommandCount = sizeof(binCommands) / sizeof(binCommands[0]);
+const int binTargetCount = sizeof(binTargets) / sizeof(binTargets[0]);
+bool inpStart = false;
+unsigned long inpTime = 0;
+
+// Faster rates the host may move the link to
+const long baudRates[] = {250000, 115200};
+long baudRate = BAUD_RATE;
+long baudPrevious = BAUD_RATE;
+bool baudTrial = false;         // Waiting to hear from the host at a new rate
+unsigned long baudTime = 0;
+unsigned long baudHeard = 0;    // Last well formed frame from the host
+
+// Unsolicited switch change events, sent once the host enables them with (SET:EVENTS:ON)
+bool eventsEnabled = false;
+const int eventSwitches[] = {SWITCH_OPENED, SWITCH_CLOSED, SWITCH_RAPARK, SWITCH_DECPARK};
+const char* const eventNames[] PROGMEM = {NAME_OPENED, NAME_CLOSED, NAME_RAPARK, NAME_DECPARK};
+bool eventSwitchOn[4];
+
+/*
+ * Switch state. A pin change interrupt notes the time of every edge on the switch pins and the
+ * loop accepts a new state once the pin has been steady for SWITCH_DEBOUNCE_MILLI, so contact
+ * bounce is never reported. The time kept for a change is its first edge, when the roof reached
+ * or left the switch, rather than when the bouncing stopped. Requests are answered from the
+ * accepted state. Without pin change interrupts, as in the host emulator, the loop notes the edges.
+ */
+const int switchPins[] = {SWITCH_1, SWITCH_2, SWITCH_3, SWITCH_4};
+volatile bool switchRaw[4];             // Contact closed at the latest edge
+volatile bool switchBouncing[4];        // Edges seen since the accepted state
+volatile unsigned long switchFirst[4];  // Time of the first of those edges
+volatile unsigned long switchLast[4];   // Time of the latest edge
+bool switchOn[4];                       // Accepted state
+unsigned long switchEdge[4];            // Time the accepted state began, 0 if it has not changed since start up
 const int cLen = 15;
 const int tLen = 15;
 const int vLen = MAX_RESPONSE;
 char command[cLen+1];
 char target[tLen+1];
 char value[vLen+1];
+char sequence[4+1];     // Sequence id tagged on the command by the host as (GET#nn:target:value), echoed in the reply
+
+/*
+ * Constant text lives in flash, a Nano has only 2 KB of SRAM. The messages are read back with the
+ * _P functions or printed through FLASH(), which costs nothing in SRAM. Moving them saved about
+ * 560 bytes of SRAM.
+ */
+#define FLASH(s) (reinterpret_cast<const __FlashStringHelper *>(s))
 
 //  Maximum length of messages = 63                                               *|
-const char* ERROR1 = "The controller response message was too long";
-const char* ERROR2 = "The controller failure message was too long";
-const char* ERROR3 = "Command input request is too long";
-const char* ERROR4 = "Invalid command syntax, both start and end tokens missing"; 
-const char* ERROR5 = "Invalid command syntax, no start token found";
-const char* ERROR6 = "Invalid command syntax, no end token found";
-const char* ERROR7 = "Roof controller unable to parse command";
-const char* ERROR8 = "Command must map to either set a relay or get a switch";
-const char* ERROR9 = "Request not implemented in controller";
-const char* ERROR10 = "Abort command ignored, roof already stationary";
-
-const char* VERSION_ID = "V0.1GT";
+const char ERROR1[] PROGMEM = "The controller response message was too long";
+const char ERROR2[] PROGMEM = "The controller failure message was too long";
+const char ERROR3[] PROGMEM = "Command input request is too long";
+const char ERROR4[] PROGMEM = "Invalid command syntax, both start and end tokens missing"; 
+const char ERROR5[] PROGMEM = "Invalid command syntax, no start token found";
+const char ERROR6[] PROGMEM = "Invalid command syntax, no end token found";
+const char ERROR7[] PROGMEM = "Roof controller unable to parse command";
+const char ERROR8[] PROGMEM = "Command must map to either set a relay or get a switch";
+const char ERROR9[] PROGMEM = "Request not implemented in controller";
+const char ERROR10[] PROGMEM = "Abort command ignored, roof already stationary";
+const char ERROR11[] PROGMEM = "Relay busy with previous command, command ignored";
+const char ERROR12[] PROGMEM = "Baud rate not supported";
+
+const char VERSION_ID[] PROGMEM = "V0.4GT";
+
+unsigned char crc8Add(unsigned char crc, unsigned char c)
+{
+  crc ^= c;
+  for (int bit = 0; bit < 8; bit++)
+    crc = (crc & 0x80) ? ((crc << 1) ^ 0x07) : (crc << 1);
+  return crc;
+}
+
+unsigned char crc8(const unsigned char* data, int len)
+{
+  unsigned char crc = 0;
+  for (int i = 0; i < len; i++)
+    crc = crc8Add(crc, data[i]);
+  return crc;
+}
+
+int binaryCode(const char* const* table, int count, const char* name)
+{
+  for (int i = 0; i < count; i++)
+  {
+    if (strcmp_P(name, (const char*)pgm_read_ptr(&table[i])) == 0)
+      return i;
+  }
+  return 0;
+}
+
+/*
+ * Replies are written piece by piece straight into the serial transmit buffer, nothing is
+ * assembled first and nothing waits for the bytes to go out. A reply that fits the 64 byte
+ * transmit buffer costs the loop about 0.1 ms instead of the 5 ms (ACK) to 20 ms (NAK) it spent
+ * in Serial.flush() at 38400 baud. Only the part of a reply beyond the free space waits.
+ * A binary frame has its CRC worked out as the bytes are written.
+ */
+unsigned char txCrc = 0;
+
+void sendByte(unsigned char c)
+{
+  txCrc = crc8Add(txCrc, c);
+  Serial.write(c);
+}
+
+void sendBinaryStart(const char* cmd, const char* tgt, int valueLen, int seq)
+{
+  Serial.write((unsigned char)BIN_SYNC);
+  txCrc = 0;
+  sendByte(BIN_HEADER + valueLen);
+  sendByte(binaryCode(binCommands, binCommandCount, cmd));
+  sendByte(binaryCode(binTargets, binTargetCount, tgt));
+  sendByte(seq);
+}
+
+void sendBinary(const char* cmd, const char* tgt, const char* val, int seq)
+{
+  if ((strcmp(val, "ON") == 0) || (strcmp(val, "OFF") == 0))
+  {
+    sendBinaryStart(cmd, tgt, 1, seq);
+    sendByte((val[1] == 'N') ? 1 : 0);
+  }
+  else if (strcmp(val, "0") == 0)
+    sendBinaryStart(cmd, tgt, 0, seq);
+  else
+  {
+    sendBinaryStart(cmd, tgt, strlen(val), seq);
+    for (const char* p = val; *p != '\0'; p++)
+      sendByte(*p);
+  }
+  Serial.write(txCrc);
+}
+
+// Opening of a text reply, (ACK or (NAK with the sequence id of the request if it had one
+void sendTextStart(const __FlashStringHelper* reply)
+{
+  Serial.print(reply);
+  if (sequence[0] != '\0')
+  {
+    Serial.write('#');
+    Serial.print(sequence);
+  }
+  Serial.write(':');
+}
 
 void sendAck(char* val)
 {
-  char response [MAX_RESPONSE];
   if (strlen(val) > MAX_MESSAGE)
     sendNak(ERROR1);
+  else if (binaryRequest)
+    sendBinary("ACK", target, val, atoi(sequence));
   else
   {  
-    strcpy(response, "(ACK:");
-    strcat(response, target);
-    strcat(response, ":");
-    strcat(response, val);
-    strcat(response, ")");
-    Serial.println(response);
-    Serial.flush();
+    sendTextStart(F("(ACK"));
+    Serial.print(target);
+    Serial.write(':');
+    Serial.print(val);
+    Serial.println(F(")"));
   }
 }
 
+// errorMsg is one of the ERRORn messages held in flash
 void sendNak(const char* errorMsg)
 {
-  char buffer[MAX_RESPONSE];
-  if (strlen(errorMsg) > MAX_MESSAGE)
+  if (strlen_P(errorMsg) > MAX_MESSAGE)
     sendNak(ERROR2);
+  else if (binaryRequest)
+  {
+    // Value is the rejected value and the message, value:message
+    sendBinaryStart("NAK", "ERROR", strlen(value) + 1 + strlen_P(errorMsg), atoi(sequence));
+    for (const char* p = value; *p != '\0'; p++)
+      sendByte(*p);
+    sendByte(':');
+    for (const char* p = errorMsg; pgm_read_byte(p) != '\0'; p++)
+      sendByte(pgm_read_byte(p));
+    Serial.write(txCrc);
+  }
   else
   {
-    strcpy(buffer, "(NAK:ERROR:");
-    strcat(buffer, value);
-    strcat(buffer, ":");
-    strcat(buffer, errorMsg);
-    strcat(buffer, ")");
-    Serial.println(buffer);
-    Serial.flush();
+    sendTextStart(F("(NAK"));
+    Serial.print(F("ERROR:"));
+    Serial.print(value);
+    Serial.write(':');
+    Serial.print(FLASH(errorMsg));
+    Serial.println(F(")"));
   }
 }
 
-void setRelay(int id, int hold, char* value)
+void sendEvent(const char* name, bool on)
 {
-  if (strcmp(value, "ON") == 0)
+  if (binaryMode)
   {
-    digitalWrite(id, HIGH);            // NO RELAY would normally already be in this condition (open)
-    delay(RELAY_PRIOR_DELAY);
-    digitalWrite(id, LOW);           // Activate the NO relay (close it) 
-    if (hold == 0)
-    {  
-      delay(RELAY_ON_DELAY);
-      digitalWrite(id, HIGH);          // Turn NO relay off
-    }
+    sendBinary("EVT", name, on ? "ON" : "OFF", 0);
+    return;
   }
+  Serial.print(F("(EVT:"));
+  Serial.print(name);
+  Serial.println(on ? F(":ON)") : F(":OFF)"));
+}
+
+void changeBaud(long rate)
+{
+  Serial.flush();               // Let the acknowledgement go at the old rate
+  Serial.end();
+  Serial.begin(rate);
+  baudRate = rate;
+}
+
+/*
+ * Start setting the relay, the delays are timed by runRelay() so the caller is not held up.
+ * Returns false if the relay is still busy with a previous command.
+ */
+bool setRelay(int id, int hold, char* value)
+{
+  if (relayState != RELAY_IDLE)
+    return false;
+  relayPin = id;
+  relayHold = hold;
+  relayPrior = RELAY_PRIOR_DELAY;
+  relayTime = millis();
+  digitalWrite(id, HIGH);              // NO RELAY would normally already be in this condition (open), or turn it off
+  if (strcmp(value, "ON") == 0)
+    relayState = RELAY_PRIOR;
   else
+    relayState = RELAY_POST;
+  return true;
+}
+
+void runRelay()
+{
+  unsigned long elapsed = millis() - relayTime;
+  switch (relayState)
   {
-    digitalWrite(id, HIGH);            // Turn NO relay off 
+    case RELAY_PRIOR:
+      if (elapsed >= relayPrior)
+      {
+        digitalWrite(relayPin, LOW);   // Activate the NO relay (close it)
+        relayTime = millis();
+        relayState = (relayHold == 0) ? RELAY_ON : RELAY_POST;
+      }
+      break;
+    case RELAY_ON:
+      if (elapsed >= RELAY_ON_DELAY)
+      {
+        digitalWrite(relayPin, HIGH);  // Turn NO relay off
+        relayTime = millis();
+        relayState = RELAY_POST;
+      }
+      break;
+    case RELAY_POST:
+      if (elapsed >= RELAY_POST_DELAY)
+      {
+        relayState = RELAY_IDLE;
+        if (stopPending)
+          startStop();
+      }
+      break;
+    default:
+      break;
   }
-  delay(RELAY_POST_DELAY);
-} 
+}
+
+/*
+ * A stop is only sent to a roof still on its way. It was set moving by an OPEN or CLOSE that has
+ * not been stopped since, it has not reached the limit switch it was heading for and it has not
+ * been moving for longer than it takes to travel. A switch that has closed but not yet settled
+ * counts as reached.
+ */
+bool isStopAllowed()
+{
+  if ((command_input != CMD_OPEN) && (command_input != CMD_CLOSE))
+    return false;
+  if ((command_input == CMD_OPEN) && isAtLimit(SWITCH_OPENED))
+    return false;
+  if ((command_input == CMD_CLOSE) && isAtLimit(SWITCH_CLOSED))
+    return false;
+  return millis() - timeMove < ROOF_OPEN_MILLI;
+}
+
+bool isAtLimit(int id)
+{
+  return isSwitchOn(id) || ((id > 0) && isContactClosed(id));
+}
+
+void stopRoof()
+{
+  command_input = CMD_STOP;
+  if (relayState == RELAY_IDLE)
+    startStop();
+  else
+    stopPending = true;
+}
+
+// Activate the relay now, without the usual RELAY_PRIOR_DELAY
+void startStop()
+{
+  char on[] = "ON";
+  stopPending = false;
+  setRelay(FUNC_STOP, FUNC_STOP_HOLD, on);
+  relayPrior = 0;
+  runRelay();
+}
 
 /*
  * Get switch value
  * Expect a NO switch configured with a pull up resistor.
  * NO switch: Inactive HIGH input to the pin with pull up resistor, logical 0 input. 
  * When switch closes The LOW voltage logical 1 is applied to the input pin. 
- * The off or on value is to be sent to the host in the ACK response
+ * The off or on value is to be sent to the host in the ACK response, it is the settled state
+ * kept by settleSwitches().
  */
 void getSwitch(int id, char* value)
 {
-  if (digitalRead(id) == OPEN_CONTACT)
-    strcpy(value, "OFF");
+  if (isSwitchOn(id))
+    strcpy(value, "ON");
   else
-    strcpy(value, "ON");  
+    strcpy(value, "OFF");  
 }
 
-bool isSwitchOn(int id)
+/*
+ * Get the state of all the switches in a single reply, one character per switch in the order
+ * OPENED, CLOSED, RAPARK, DECPARK. '1' is ON, '0' is OFF or not implemented.
+ * Lets the host take one consistent snapshot instead of a request per switch.
+ */
+void getAllSwitches(char* value)
+{
+  const int ids[] = {SWITCH_OPENED, SWITCH_CLOSED, SWITCH_RAPARK, SWITCH_DECPARK};
+  for (int i = 0; i < 4; i++)
+    value[i] = isSwitchOn(ids[i]) ? '1' : '0';
+  value[4] = '\0';
+}
+
+/*
+ * Milliseconds since each switch last changed, comma separated in the order OPENED, CLOSED,
+ * RAPARK, DECPARK. Ages rather than times so the host need not know the controller's clock,
+ * it subtracts them from when the reply arrived. A switch that has not changed since start up
+ * reports the time since then.
+ */
+void getSwitchEdges(char* value)
 {
-  char switch_value[16+1];
-  getSwitch(id, switch_value);
-  if (strcmp(switch_value, "ON") == 0)
+  const int ids[] = {SWITCH_OPENED, SWITCH_CLOSED, SWITCH_RAPARK, SWITCH_DECPARK};
+  unsigned long timeNow = millis();
+  value[0] = '\0';
+  for (int i = 0; i < 4; i++)
   {
-    return true;
-  }   
-  return false;
+    int index = switchIndex(ids[i]);
+    if (i > 0)
+      strcat(value, ",");
+    ultoa((index >= 0) ? timeNow - switchEdge[index] : 0, value + strlen(value), 10);
+  }
 }
 
-bool parseCommand()           // (command:target:value)
+int switchIndex(int id)
 {
-  bool start = false;
-  bool eof = false;
-  int recv_count = 0;
-  int wait = 0;
-  int offset = 0;
-  char startToken = '(';
-  char endToken = ')';
-  const int bLen = MAX_INPUT;
-  char inpBuf[bLen+1];
+  for (int i = 0; i < 4; i++)
+  {
+    if ((id > 0) && (switchPins[i] == id))
+      return i;
+  }
+  return -1;
+}
 
-  memset(inpBuf, 0, sizeof(inpBuf));
-  memset(command, 0, sizeof(command));
-  memset(target, 0, sizeof(target));
-  memset(value, 0, sizeof(value));
-    
-  while (!eof && (wait < 20))
+bool isSwitchOn(int id)
+{
+  int index = switchIndex(id);
+  return (index >= 0) && switchOn[index];
+}
+
+bool isContactClosed(int id)
+{
+  return digitalRead(id) != OPEN_CONTACT;
+}
+
+// Note the time of any switch edges, called from the pin change interrupt
+void noteSwitchEdges()
+{
+  unsigned long timeNow = millis();
+  for (int i = 0; i < 4; i++)
   {
-    if (Serial.available() > 0)
+    if (switchPins[i] > 0)
     {
-      Serial.setTimeout(1000);
-      recv_count = Serial.readBytes((inpBuf + offset), 1);
-      if (recv_count == 1)
+      bool closed = isContactClosed(switchPins[i]);
+      if (closed != switchRaw[i])
       {
-        offset++;
-        if (offset >= MAX_INPUT)
-        {
-          sendNak(ERROR3);
-          return false;        
-        }
-        if (inpBuf[offset-1] == startToken)
+        switchRaw[i] = closed;
+        switchLast[i] = timeNow;
+        if (!switchBouncing[i])
         {
-          start = true;  
+          switchBouncing[i] = true;
+          switchFirst[i] = timeNow;
         }
-        if (inpBuf[offset-1] == endToken) 
+      }
+    }
+  }
+}
+
+#ifdef PCINT2_vect
+ISR(PCINT0_vect)
+{
+  noteSwitchEdges();
+}
+ISR(PCINT1_vect, ISR_ALIASOF(PCINT0_vect));
+ISR(PCINT2_vect, ISR_ALIASOF(PCINT0_vect));
+#endif
+
+/*
+ * Accept the state of any switch that has been steady long enough since its last edge. A switch
+ * that bounced back to where it was is left as it was.
+ */
+void settleSwitches()
+{
+#ifndef PCINT2_vect
+  noteSwitchEdges();
+#endif
+  unsigned long timeNow = millis();
+  for (int i = 0; i < 4; i++)
+  {
+    // The state and its edge time are taken together, an edge landing after them starts a new bounce
+    noInterrupts();
+    bool steady = switchBouncing[i] && (timeNow - switchLast[i] >= SWITCH_DEBOUNCE_MILLI);
+    bool raw = switchRaw[i];
+    unsigned long first = switchFirst[i];
+    if (steady)
+      switchBouncing[i] = false;
+    interrupts();
+    if (steady && (raw != switchOn[i]))
+    {
+      switchOn[i] = raw;
+      switchEdge[i] = first;
+    }
+  }
+}
+
+/*
+ * Compare each switch with its last reported state, when it has changed and events are enabled
+ * let the host know without waiting to be asked.
+ */
+void checkSwitchEvents()
+{
+  for (int i = 0; i < 4; i++)
+  {
+    if (eventSwitches[i] > 0)
+    {
+      bool on = isSwitchOn(eventSwitches[i]);
+      if (on != eventSwitchOn[i])
+      {
+        eventSwitchOn[i] = on;
+        if (eventsEnabled)
         {
-          eof = true;
-          inpBuf[offset] = '\0';           
+          char name[tLen+1];
+          strcpy_P(name, (const char*)pgm_read_ptr(&eventNames[i]));
+          sendEvent(name, on);
         }
-        continue;
       }
     }
-    wait++;
-    delay(100);
   }
-    
-  if (!start || !eof)
+}
+
+void resetInput()
+{
+  inpCount = 0;
+  inpStart = false;
+  binCount = 0;
+}
+
+void startInput()
+{
+  inpTime = millis();
+  memset(command, 0, sizeof(command));
+  memset(target, 0, sizeof(target));
+  memset(value, 0, sizeof(value));
+  memset(sequence, 0, sizeof(sequence));
+}
+
+/*
+ * Collect a binary frame a byte at a time. Returns true once a complete frame has passed its CRC,
+ * a frame that fails is dropped and the host left to time out.
+ */
+bool collectBinary(unsigned char c)
+{
+  binBuf[binCount++] = c;
+  if ((binCount == 2) && ((c < BIN_HEADER) || (c > MAX_INPUT - BIN_OVERHEAD)))
   {
-    if (!start && !eof)  
-      sendNak(ERROR4);
-    else if (!start)
-      sendNak(ERROR5);
-    else if (!eof)
-      sendNak(ERROR6);
+    binCount = 0;               // Not a real sync byte
     return false;
   }
+  if ((binCount < 2) || (binCount < binBuf[1] + BIN_OVERHEAD))
+    return false;
+  binCount = 0;
+  return crc8(binBuf + 1, binBuf[1] + 1) == binBuf[binBuf[1] + 2];
+}
+
+/*
+ * Expand a binary frame into command, target, value and sequence as though it had arrived as text
+ */
+bool decodeBinary()
+{
+  int valueLen = binBuf[1] - BIN_HEADER;
+  if ((binBuf[2] == 0) || (binBuf[2] >= binCommandCount) || (binBuf[3] >= binTargetCount))
+  {
+    sendNak(ERROR7);
+    return false;
+  }
+  strcpy_P(command, (const char*)pgm_read_ptr(&binCommands[binBuf[2]]));
+  strcpy_P(target, (const char*)pgm_read_ptr(&binTargets[binBuf[3]]));
+  itoa(binBuf[4], sequence, 10);
+  if (valueLen == 0)
+    strcpy(value, "0");
+  else if ((valueLen == 1) && (binBuf[5] <= 1))
+    strcpy(value, (binBuf[5] == 1) ? "ON" : "OFF");
   else
   {
-    strcpy(command, strtok(inpBuf,"(:"));
-    strcpy(target, strtok(NULL,":"));
-    strcpy(value, strtok(NULL,")"));
-    if ((strlen(command) >= 3) && (strlen(target) >= 1) && (strlen(value) >= 1))
+    memcpy(value, binBuf + 5, valueLen);
+    value[valueLen] = '\0';
+  }
+  return true;
+}
+
+/*
+ * Collect whatever input is available without waiting for more. Returns true once a complete
+ * command has been received and split into command, target and value.
+ */
+bool parseCommand()           // (command:target:value)
+{
+  char startToken = '(';
+  char endToken = ')';
+
+  while (Serial.available() > 0)
+  {
+    int c = Serial.read();
+
+    // A sync byte outside of a text command starts a binary frame
+    if ((binCount > 0) || ((inpCount == 0) && (c == BIN_SYNC)))
     {
-      return true;
+      if (binCount == 0)
+        startInput();
+      if (collectBinary(c))
+      {
+        baudHeard = millis();   // Only a frame at the present rate passes its CRC
+        binaryRequest = true;
+        return decodeBinary();
+      }
+      continue;
     }
-    else
-    {  
-      sendNak(ERROR7); 
+
+    // A start token begins a new command, dropping anything before it such as bytes garbled by a
+    // host at another baud rate
+    if ((c == startToken) && (inpCount > 0))
+      resetInput();
+    if (inpCount == 0)
+    {
+      startInput();
+      binaryRequest = false;
+    }
+    inpBuf[inpCount++] = c;
+    if (inpCount >= MAX_INPUT)
+    {
+      resetInput();
+      sendNak(ERROR3);
       return false;
     }
-  }              
+    if (inpBuf[inpCount-1] == startToken)
+      inpStart = true;
+    if (inpBuf[inpCount-1] == endToken)
+    {
+      inpBuf[inpCount] = '\0';
+      bool start = inpStart;
+      resetInput();
+      if (start)
+        baudHeard = millis();   // Framed as sent, so the host is at the present rate
+      if (!start)
+      {
+        sendNak(ERROR5);
+        return false;
+      }
+      strcpy(command, strtok(inpBuf,"(:"));
+      strcpy(target, strtok(NULL,":"));
+      strcpy(value, strtok(NULL,")"));
+
+      // Split off a sequence id so the reply can be matched to its request
+      char* tag = strchr(command, '#');
+      if (tag != NULL)
+      {
+        *tag = '\0';
+        strncpy(sequence, tag + 1, sizeof(sequence) - 1);
+      }
+      if ((strlen(command) >= 3) && (strlen(target) >= 1) && (strlen(value) >= 1))
+      {
+        return true;
+      }
+      else
+      {
+        sendNak(ERROR7);
+        return false;
+      }
+    }
+  }
+
+  // Give up on a command that stopped arriving part way through, a partial binary frame is just dropped
+  if ((binCount > 0) && (millis() - inpTime >= INPUT_TIMEOUT))
+    resetInput();
+  if ((inpCount > 0) && (millis() - inpTime >= INPUT_TIMEOUT))
+  {
+    if (!inpStart)
+      sendNak(ERROR4);
+    else
+      sendNak(ERROR6);
+    resetInput();
+  }
+  return false;
 }
 
 /*
@@ -262,53 +778,133 @@ bool parseCommand()           // (command:target:value)
  */
 void readUSB()
 {
-  // Confirm there is input available, read and parse it.
-  if (Serial && (Serial.available() > 0))
+  // Collect any input available, act on it once a command is complete.
+  if (Serial)
   {
     if (parseCommand())
     {
+      baudTrial = false;        // Host can be heard at the present rate
       unsigned long timeNow = millis();
       int hold = 0;
       int relay = -1;   // -1 = not found, 0 = not implemented, pin number = supported
       int sw = -1;      //      "                 "                    "
+      cmd_input move = CMD_NONE;  // Roof move the relay starts, only recorded once it is accepted
       bool connecting = false;
+      bool replied = false;     // Response already sent
       const char* error = ERROR8;
 
       // On initial connection return the version
+      // A host asking for SEQ is told sequence ids are supported by the SEQ target in the reply.
+      // A new connection starts without events until the host asks for them.
       if (strcmp(command, "CON") == 0)
       {
         connecting = true; 
-        strcpy(value, VERSION_ID);  // Can be seen on host to confirm what is running       
+        eventsEnabled = false;
+        binaryMode = false;
+        if (strcmp(value, "SEQ") == 0)
+          strcpy(target, "SEQ");
+        strcpy_P(value, VERSION_ID);  // Can be seen on host to confirm what is running       
         sendAck(value);
       }
 
       // Map the general input command term to the local action
-      // SET: OPEN, CLOSE
+      // SET: OPEN, CLOSE, ABORT, EVENTS, BINARY, BAUD
       else if (strcmp(command, "SET") == 0)
       {
+        // Acknowledge at the present rate then listen at the new one. If the host is not heard
+        // from at the new rate within BAUD_TRIAL_MILLI go back to the present one.
+        if (strcmp(target, "BAUD") == 0)
+        {
+          replied = true;
+          long rate = atol(value);
+          bool supported = false;
+          for (unsigned int i = 0; i < sizeof(baudRates) / sizeof(baudRates[0]); i++)
+            supported = supported || (baudRates[i] == rate);
+          if (supported)
+          {
+            sendAck(value);
+            baudPrevious = baudRate;
+            changeBaud(rate);
+            baudTrial = true;
+            baudTime = millis();
+          }
+          else
+            sendNak(ERROR12);
+        }
+        // Binary frames from here on, this reply still goes back as the request arrived
+        else if (strcmp(target, "BINARY") == 0)
+        {
+          replied = true;
+          binaryMode = (strcmp(value, "ON") == 0);
+          sendAck(value);
+        }
+        // Enable or disable switch change events, starting from the present switch states
+        else if (strcmp(target, "EVENTS") == 0)
+        {
+          replied = true;
+          eventsEnabled = (strcmp(value, "ON") == 0);
+          for (int i = 0; i < 4; i++)
+            eventSwitchOn[i] = (eventSwitches[i] > 0) && isSwitchOn(eventSwitches[i]);
+          sendAck(value);
+        }
+        // Stop the roof at once, ahead of the reply. Rejected when the roof is not on its way,
+        // a pulse to a stationary single button controller would set it off again. Rejected too
+        // without a relay for it, pin 0 is the serial RX pin.
+        else if (strcmp(target, "ABORT") == 0)
+        {
+          if (FUNC_STOP <= 0)
+            error = ERROR9;
+          else if (isStopAllowed())
+          {
+            replied = true;
+            stopRoof();
+            sendAck(value);
+          }
+          else
+            error = ERROR10;
+        }
         // Prepare to OPEN
-        if (strcmp(target, "OPEN") == 0)                     
+        else if (strcmp(target, "OPEN") == 0)                     
         {
-          command_input = CMD_OPEN;
+          move = CMD_OPEN;
           relay = FUNC_OPEN;
           hold = FUNC_OPEN_HOLD;
-          timeMove = timeNow;
         }
         // Prepare to CLOSE
         else if (strcmp(target, "CLOSE") == 0)    
         { 
-          command_input = CMD_CLOSE;
+          move = CMD_CLOSE;
           relay = FUNC_CLOSE;
           hold = FUNC_CLOSE_HOLD;
-          timeMove = timeNow;
         }
       }
 
       // Handle requests to obtain the status of switches   
-      // GET: OPENED, CLOSED, LOCKED, AUXSTATE
+      // GET: OPENED, CLOSED, LOCKED, AUXSTATE, ALL, EDGES, BAUD
       else if (strcmp(command, "GET") == 0)
       {
-        if (strcmp(target, "OPENED") == 0)
+        // Present link rate, the host uses this to confirm a new rate works
+        if (strcmp(target, "BAUD") == 0)
+        {
+          replied = true;
+          ltoa(baudRate, value, 10);
+          sendAck(value);
+        }
+        // All switches in one reply, the host falls back to single requests if this is rejected
+        else if (strcmp(target, "ALL") == 0)
+        {
+          replied = true;
+          getAllSwitches(value);
+          sendAck(value);
+        }
+        // How long ago each switch changed, lets the host time the roof better than it polls
+        else if (strcmp(target, "EDGES") == 0)
+        {
+          replied = true;
+          getSwitchEdges(value);
+          sendAck(value);
+        }
+        else if (strcmp(target, "OPENED") == 0)
           sw = SWITCH_OPENED;
         else if (strcmp(target, "CLOSED") == 0) 
           sw = SWITCH_CLOSED;
@@ -321,7 +917,7 @@ void readUSB()
       /*
        * See if there was a valid command or request 
        */
-      if (!connecting)
+      if (!connecting && !replied)
       {
         if ((relay == -1) && (sw == -1))
         {
@@ -340,9 +936,15 @@ void readUSB()
         
         // A command was received
         // Set the relay associated with the command and send acknowlege to host
+        // A command refused as the relay is busy leaves the roof as it was, so a later
+        // ABORT is not taken as stopping a move that never started
         else if (relay > 0)            // Set Relay response
         {
-          commandReceived(relay, hold, value);
+          if (commandReceived(relay, hold, value) && (move != CMD_NONE))
+          {
+            command_input = move;
+            timeMove = timeNow;
+          }
         }
         
         // A state request was received
@@ -350,7 +952,7 @@ void readUSB()
         {
           requestReceived(sw);    
         }
-      } // end !connecting
+      } // end !connecting && !replied
     }   // end command parsed
   }     // end Serial input found  
 }
@@ -370,11 +972,17 @@ void readUSB()
 // hold:  whether relay is to be set permanently =0, or temporarily =1
 // value: How to set the relay "ON" or "OFF" 
 // 
+// Returns false if the relay was busy and the command refused.
 //
-void commandReceived(int relay, int hold, char* value)
+bool commandReceived(int relay, int hold, char* value)
 {
-  setRelay(relay, hold, value);
-  sendAck(value);         // Send acknowledgement that relay pin associated with "target" was activated to value requested
+  if (setRelay(relay, hold, value))
+  {
+    sendAck(value);         // Send acknowledgement that relay pin associated with "target" is being set to value requested
+    return true;
+  }
+  sendNak(ERROR11);
+  return false;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -387,7 +995,7 @@ void commandReceived(int relay, int hold, char* value)
 // if (strcmp(target, "OPENED") == 0) {do something}
 //
 // sw:     The switch's pin identifier.
-// value   getSwitch will read the pin and set this to "ON" or "OFF" 
+// value   getSwitch will set this to the settled state of the switch, "ON" or "OFF" 
 void requestReceived(int sw)
 {
   getSwitch(sw, value);
@@ -404,6 +1012,18 @@ void setup()
   pinMode(SWITCH_2, INPUT_PULLUP); 
   pinMode(SWITCH_3, INPUT_PULLUP); 
   pinMode(SWITCH_4, INPUT_PULLUP);
+  for (int i = 0; i < 4; i++)
+  {
+    if (switchPins[i] > 0)
+    {
+      switchRaw[i] = isContactClosed(switchPins[i]);
+      switchOn[i] = switchRaw[i];
+#ifdef PCINT2_vect
+      *digitalPinToPCMSK(switchPins[i]) |= bit(digitalPinToPCMSKbit(switchPins[i]));
+      *digitalPinToPCICR(switchPins[i]) |= bit(digitalPinToPCICRbit(switchPins[i]));
+#endif
+    }
+  }
 
   // Initialize the relays
   //Pin Setups
@@ -414,23 +1034,28 @@ void setup()
 
   // Establish USB port.
   Serial.begin(BAUD_RATE);    // Baud rate to match that in the driver
+
+  // Opening the port resets the board, tell a host waiting on that the sketch is running
+  Serial.print(F("(EVT:READY:"));
+  Serial.print(FLASH(VERSION_ID));
+  Serial.println(F(")"));
 }
 
-// Wait here for command or switch request from host
+// Service the host, the relay and the switches on every pass, nothing here waits
 void loop() 
 {   
-  while (Serial.available() <= 0) 
+  readUSB();
+  runRelay();
+  if (baudTrial && (millis() - baudTime >= BAUD_TRIAL_MILLI))
   {
-    for (int cnt=0; cnt < 60; cnt++)
-    {
-      if (Serial.available() > 0)
-        break;
-      else
-        delay(100);
-    }
+    baudTrial = false;
+    changeBaud(baudPrevious);
   }
-  readUSB();
+  // A host that closed the port without resetting the board opens it again at BAUD_RATE. The
+  // driver reads the switches at least every 10 seconds, moving or not, so only a host that has
+  // gone quiet is dropped.
+  if (!baudTrial && baudRate != BAUD_RATE && (millis() - baudHeard >= BAUD_IDLE_MILLI))
+    changeBaud(BAUD_RATE);
+  settleSwitches();
+  checkSwitchEvents();
 }       // end loop
-
-
-  
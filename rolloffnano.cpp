@@ -28,43 +28,96 @@
 #include "indicom.h"
 #include "termios.h"
 
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
 #include <cmath>
+#include <cstdarg>
+#include <cstdlib>
 #include <cstring>
 #include <ctime>
 #include <memory>
+#include <vector>
 
 #define ROLLOFF_DURATION 15  // Seconds until Roof is fully opened or closed
 #define INACTIVE_STATUS 5    // Seconds between updating status lights
-#define ROR_D_PRESS 1000     // Milliseconds after issuing command before expecting response
 #define MAX_CNTRL_COM_ERR 10 // Maximum consecutive errors communicating with Arduino
+#define HEARTBEAT_INTERVAL 10 // Seconds between switch reads with switch events, keeps the link at its negotiated rate
+#define HEARTBEAT_MISSES 3   // Failed switch reads in a row taken as a lost link
+#define RECONNECT_FIRST 1000 // Milliseconds before the first reconnect attempt, doubled after each failure
+#define RECONNECT_MAX 60000  // Longest wait between reconnect attempts
+#define BAUD_TRIAL 1000      // Milliseconds the controller waits at a new baud rate for a valid request
+#define CONTACT_WAIT 250     // Milliseconds for a controller that is already running to answer
+#define READY_DEADLINE 3000  // Milliseconds for a controller reset by opening the port to report it is ready
+#define MOTION_POLL 1000     // Milliseconds between polls while moving when the travel time is not known
+#define MOTION_CONFIRM 2000  // Milliseconds after starting the roof to check it has left its limit switch
+#define ARRIVAL_POLL 250     // Milliseconds between polls as the roof nears its expected arrival
+#define POSITION_UPDATE 250  // Milliseconds between estimates of the roof position while it moves
+#define POSITION_LIMIT 99    // Furthest percent along its travel the roof is estimated before reaching the switch
+#define TRAVEL_MIN_MOVES 5   // Moves measured in a direction before its timeout is set from them
+#define TRAVEL_MARGIN 3      // Seconds added to the p99 travel time for the timeout, or 10% if that is more
+#define TRAVEL_SLOWING 1.2   // Recent moves this much slower than usual warn of a drive in need of attention
+#define ARRIVAL_WINDOW 0.5   // Seconds ahead of the expected arrival to start polling at ARRIVAL_POLL, plus 5% of the travel
+#define SIM_TRAVEL_MARGIN 5  // Seconds the simulated roof arrives ahead of the timeout set in the options
+#define SIM_TRAVEL_MIN 2     // Shortest simulated travel, however short the timeout
+#define DIAGNOSTICS_TAB "Diagnostics"
+#define SIMULATION_TAB "Simulation"
+
 // Read only
 #define ROOF_OPENED_SWITCH "OPENED"
 #define ROOF_CLOSED_SWITCH "CLOSED"
+#define ROOF_ALL_SWITCHES "ALL"     // OPENED, CLOSED, RAPARK, DECPARK as one "1000" style value
+#define ROOF_SWITCH_EDGES "EDGES"   // Milliseconds since each of them changed, "120,5310,..." in the same order
 
 // Write only
 #define ROOF_OPEN_RELAY "OPEN"
 #define ROOF_CLOSE_RELAY "CLOSE"
-
-// Arduino controller interface limits
-#define MAXINOCMD 15    // Command buffer
-#define MAXINOTARGET 15 // Target buffer
-#define MAXINOVAL 127   // Value bufffer, sized to contain NAK error strings
-#define MAXINOLINE 63   // Sized to contain outgoing command requests
-#define MAXINOBUF 255   // Sized for maximum overall input / output
-#define MAXINOERR 255   // System call error message buffer
-#define MAXINOWAIT 2    // seconds
+#define ROOF_ABORT_RELAY "ABORT"
 
 // Driver version id
 #define VERSION_ID "20240930nano"
 
-// We declare an auto pointer to rollOffNano.
-std::unique_ptr<RollOffNano> rollOffNano(new RollOffNano());
+#define MAX_ROOFS 8          // Roofs one process can run, set by ROLLOFFNANO_ROOFS in the environment
+
+static const int baudRates[] = { 250000, 115200 }; // Faster rates the link is moved to, fastest first
+
+// The roofs run by this process, each its own device with its own controller
+static std::vector<std::unique_ptr<RollOffNano>> createRoofs()
+{
+    std::vector<std::unique_ptr<RollOffNano>> created;
+    const char *setting = getenv("ROLLOFFNANO_ROOFS");
+    int count = std::max(1, std::min(setting != nullptr ? atoi(setting) : 1, MAX_ROOFS));
+
+    for (int roof = 1; roof <= count; roof++)
+        created.emplace_back(new RollOffNano(roof));
+    return created;
+}
+
+static std::vector<std::unique_ptr<RollOffNano>> roofs = createRoofs();
+
+thread_local RollOffNano::InoContact *RollOffNano::loggingTo = nullptr;
+
+static RollOffNano *findRoof(const char *dev)
+{
+    for (auto &roof : roofs)
+    {
+        if (dev != nullptr && strcmp(dev, roof->getDeviceName()) == 0)
+            return roof.get();
+    }
+    return nullptr;
+}
 
 void ISPoll(void *p);
 
 void ISGetProperties(const char *dev)
 {
-    rollOffNano->ISGetProperties(dev);
+    for (auto &roof : roofs)
+    {
+        if (dev == nullptr || roof.get() == findRoof(dev))
+            roof->ISGetProperties(dev);
+    }
 }
 
 void RollOffNano::ISGetProperties(const char *dev)
@@ -74,21 +127,39 @@ void RollOffNano::ISGetProperties(const char *dev)
     // Load Sync position
     defineProperty(&RoofTimeoutNP);
     loadConfig(true, "ENCODER_TICKS");
+    defineProperty(&AutoTimeoutSP);
+    defineProperty(&RoofTravelTP);
+    defineProperty(&SwitchCacheNP);
+    defineProperty(&PublishNP);
+    defineProperty(&ResetSP);
+    loadConfig(true, SwitchCacheNP.name);
+    loadConfig(true, ResetSP.name);
+    loadConfig(true, PublishNP.name);
+    loadConfig(true, AutoTimeoutSP.name);
+    loadConfig(true, RoofTravelTP.name);
+    if (roofs.size() > 1)
+        defineProperty(&CloseAllSP);
 }
 
 void ISNewSwitch(const char *dev, const char *name, ISState *states, char *names[], int n)
 {
-    rollOffNano->ISNewSwitch(dev, name, states, names, n);
+    RollOffNano *roof = findRoof(dev);
+    if (roof != nullptr)
+        roof->ISNewSwitch(dev, name, states, names, n);
 }
 
 void ISNewText(const char *dev, const char *name, char *texts[], char *names[], int n)
 {
-    rollOffNano->ISNewText(dev, name, texts, names, n);
+    RollOffNano *roof = findRoof(dev);
+    if (roof != nullptr)
+        roof->ISNewText(dev, name, texts, names, n);
 }
 
 void ISNewNumber(const char *dev, const char *name, double values[], char *names[], int n)
 {
-    rollOffNano->ISNewNumber(dev, name, values, names, n);
+    RollOffNano *roof = findRoof(dev);
+    if (roof != nullptr)
+        roof->ISNewNumber(dev, name, values, names, n);
 }
 
 bool RollOffNano::ISNewNumber(const char *dev, const char *name, double values[], char *names[], int n)
@@ -100,6 +171,30 @@ bool RollOffNano::ISNewNumber(const char *dev, const char *name, double values[]
             IUUpdateNumber(&RoofTimeoutNP, values, names, n);
             RoofTimeoutNP.s = IPS_OK;
             IDSetNumber(&RoofTimeoutNP, nullptr);
+            inoSim.setTravel(simulatedTravel());
+            return true;
+        }
+        if (!strcmp(SwitchCacheNP.name, name))
+        {
+            IUUpdateNumber(&SwitchCacheNP, values, names, n);
+            SwitchCacheNP.s = IPS_OK;
+            IDSetNumber(&SwitchCacheNP, nullptr);
+            return true;
+        }
+        if (!strcmp(PublishNP.name, name))
+        {
+            IUUpdateNumber(&PublishNP, values, names, n);
+            PublishNP.s = IPS_OK;
+            IDSetNumber(&PublishNP, nullptr);
+            return true;
+        }
+        if (!strcmp(SimClockNP.name, name))
+        {
+            IUUpdateNumber(&SimClockNP, values, names, n);
+            inoSim.setTimeScale(SimClockN[0].value);
+            SimClockNP.s = IPS_OK;
+            IDSetNumber(&SimClockNP, nullptr);
+            scheduleTimer(0); // Timers already waiting were set at the old scale
             return true;
         }
     }
@@ -122,7 +217,8 @@ void ISNewBLOB(const char *dev, const char *name, int sizes[], int blobsizes[],
 
 void ISSnoopDevice(XMLEle *root)
 {
-    rollOffNano->ISSnoopDevice(root);
+    for (auto &roof : roofs)
+        roof->ISSnoopDevice(root);
 }
 
 bool RollOffNano::ISSnoopDevice(XMLEle *root)
@@ -130,9 +226,46 @@ bool RollOffNano::ISSnoopDevice(XMLEle *root)
     return INDI::Dome::ISSnoopDevice(root);
 }
 
-RollOffNano::RollOffNano()
+/*
+ * The first roof keeps the usual device name so single roof setups are unchanged, further
+ * roofs are numbered from 2.
+ */
+RollOffNano::RollOffNano(int roof)
 {
     SetDomeCapability(DOME_CAN_ABORT | DOME_CAN_PARK); // Need the DOME_CAN_PARK capability for the scheduler
+    inoLink.setEventHandler(linkEventHelper, this);
+    if (roof > 1)
+    {
+        char name[MAXINDINAME];
+        snprintf(name, sizeof(name), "%s %d", getDefaultName(), roof);
+        setDeviceName(name);
+    }
+}
+
+RollOffNano::~RollOffNano()
+{
+    if (contactThread.joinable())
+        contactThread.join();
+}
+
+/*
+ * Park every connected roof in the process. Each goes through its own park request, the
+ * commands go out on all the links together.
+ */
+void RollOffNano::closeAllRoofs()
+{
+    ISState states[] = { ISS_ON, ISS_OFF };
+    char park[] = "PARK";
+    char unpark[] = "UNPARK";
+    char *names[] = { park, unpark };
+
+    LOG_INFO("Closing all roofs");
+    for (auto &roof : roofs)
+    {
+        if (!roof->isConnected())
+            continue;
+        roof->INDI::Dome::ISNewSwitch(roof->getDeviceName(), "DOME_PARK", states, names, 2);
+    }
 }
 
 /**************************************************************************************
@@ -153,12 +286,104 @@ bool RollOffNano::initProperties()
     IUFillLight(&RoofStatusL[ROOF_STATUS_OPENED], "ROOF_OPENED", "Opened", IPS_IDLE);
     IUFillLight(&RoofStatusL[ROOF_STATUS_CLOSED], "ROOF_CLOSED", "Closed", IPS_IDLE);
     IUFillLight(&RoofStatusL[ROOF_STATUS_MOVING], "ROOF_MOVING", "Moving", IPS_IDLE);
-    IUFillLightVector(&RoofStatusLP, RoofStatusL, 5, getDeviceName(), "ROOF STATUS", "Roof Status", MAIN_CONTROL_TAB, IPS_BUSY);
+    IUFillLightVector(&RoofStatusLP, RoofStatusL, 3, getDeviceName(), "ROOF STATUS", "Roof Status", MAIN_CONTROL_TAB, IPS_BUSY);
+
+    // Estimated from the travel times, 0 is closed and 100 opened
+    IUFillNumber(&RoofPositionN[POSITION_OPEN], "POSITION_OPEN", "Open (%)", "%3.0f", 0, 100, 0, 0);
+    IUFillNumber(&RoofPositionN[POSITION_REMAINING], "POSITION_REMAINING", "Time to go (s)", "%5.1f", 0, 1000, 0, 0);
+    IUFillNumberVector(&RoofPositionNP, RoofPositionN, 2, getDeviceName(), "ROOF_POSITION", "Roof Position", MAIN_CONTROL_TAB,
+                       IP_RO, 60, IPS_IDLE);
 
     IUFillNumber(&RoofTimeoutN[0], "ROOF_TIMEOUT", "Timeout in Seconds", "%3.0f", 1, 300, 1, 15);
     IUFillNumberVector(&RoofTimeoutNP, RoofTimeoutN, 1, getDeviceName(), "ROOF_MOVEMENT", "Roof Movement", OPTIONS_TAB, IP_RW,
                        60, IPS_IDLE);
 
+    // Switch states read within this many milliseconds are used again rather than asking the controller
+    IUFillNumber(&SwitchCacheN[0], "SWITCH_FRESH_MS", "Switches fresh for (ms)", "%5.0f", 0, 10000, 100, 500);
+    IUFillNumberVector(&SwitchCacheNP, SwitchCacheN, 1, getDeviceName(), "SWITCH_CACHE", "Switch Cache", OPTIONS_TAB, IP_RW,
+                       60, IPS_IDLE);
+
+    // Status changes closer together than this are sent to clients as one
+    IUFillNumber(&PublishN[0], "MIN_INTERVAL_MS", "Minimum interval (ms)", "%5.0f", 0, 10000, 100, 500);
+    IUFillNumberVector(&PublishNP, PublishN, 1, getDeviceName(), "STATUS_UPDATES", "Status Updates", OPTIONS_TAB, IP_RW,
+                       60, IPS_IDLE);
+
+    IUFillSwitch(&AutoTimeoutS[AUTO_TIMEOUT_ENABLE], "AUTO_TIMEOUT_ENABLE", "Enable", ISS_ON);
+    IUFillSwitch(&AutoTimeoutS[AUTO_TIMEOUT_DISABLE], "AUTO_TIMEOUT_DISABLE", "Disable", ISS_OFF);
+    IUFillSwitchVector(&AutoTimeoutSP, AutoTimeoutS, 2, getDeviceName(), "ROOF_AUTO_TIMEOUT", "Timeout from travel", OPTIONS_TAB, IP_RW,
+                       ISR_1OFMANY, 0, IPS_IDLE);
+
+    IUFillNumber(&RoofTravelN[TRAVEL_OPEN_P50], "OPEN_P50", "Open median (s)", "%5.1f", 0, 1000, 0, 0);
+    IUFillNumber(&RoofTravelN[TRAVEL_OPEN_P99], "OPEN_P99", "Open p99 (s)", "%5.1f", 0, 1000, 0, 0);
+    IUFillNumber(&RoofTravelN[TRAVEL_OPEN_TIMEOUT], "OPEN_TIMEOUT", "Open timeout (s)", "%5.1f", 0, 1000, 0, 0);
+    IUFillNumber(&RoofTravelN[TRAVEL_CLOSE_P50], "CLOSE_P50", "Close median (s)", "%5.1f", 0, 1000, 0, 0);
+    IUFillNumber(&RoofTravelN[TRAVEL_CLOSE_P99], "CLOSE_P99", "Close p99 (s)", "%5.1f", 0, 1000, 0, 0);
+    IUFillNumber(&RoofTravelN[TRAVEL_CLOSE_TIMEOUT], "CLOSE_TIMEOUT", "Close timeout (s)", "%5.1f", 0, 1000, 0, 0);
+    IUFillNumberVector(&RoofTravelNP, RoofTravelN, 6, getDeviceName(), "ROOF_TRAVEL", "Roof Travel", OPTIONS_TAB, IP_RO, 60,
+                       IPS_IDLE);
+
+    // Seconds taken by recent moves, oldest first. Kept in the configuration, clear to start again.
+    IUFillText(&RoofTravelT[DOME_CW], "OPEN_HISTORY", "Open moves", "");
+    IUFillText(&RoofTravelT[DOME_CCW], "CLOSE_HISTORY", "Close moves", "");
+    IUFillTextVector(&RoofTravelTP, RoofTravelT, 2, getDeviceName(), "ROOF_TRAVEL_HISTORY", "Travel History", OPTIONS_TAB, IP_RW,
+                     60, IPS_IDLE);
+
+    IUFillNumber(&LinkN[LINK_BAUD], "LINK_BAUD", "Baud rate", "%6.0f", 0, 1000000, 0, 0);
+    IUFillNumber(&LinkN[LINK_CONNECT], "CONNECT_MS", "Connect time (ms)", "%6.0f", 0, 100000, 0, 0);
+    IUFillNumber(&LinkN[LINK_ABORT], "ABORT_MS", "Last abort (ms)", "%6.0f", 0, 100000, 0, 0);
+    IUFillNumberVector(&LinkNP, LinkN, 3, getDeviceName(), "CONTROLLER_LINK", "Controller Link", CONNECTION_TAB, IP_RO,
+                       60, IPS_IDLE);
+
+    // Controller link counters since the driver started
+    IUFillNumber(&LinkCountersN[COUNT_TRANSACTIONS], "TRANSACTIONS", "Transactions", "%10.0f", 0, 0, 0, 0);
+    IUFillNumber(&LinkCountersN[COUNT_TIMEOUTS], "TIMEOUTS", "Timeouts", "%10.0f", 0, 0, 0, 0);
+    IUFillNumber(&LinkCountersN[COUNT_NAKS], "NAKS", "NAKs", "%10.0f", 0, 0, 0, 0);
+    IUFillNumber(&LinkCountersN[COUNT_MALFORMED], "MALFORMED", "Malformed frames", "%10.0f", 0, 0, 0, 0);
+    IUFillNumber(&LinkCountersN[COUNT_BYTES_IN], "BYTES_IN", "Bytes in", "%10.0f", 0, 0, 0, 0);
+    IUFillNumber(&LinkCountersN[COUNT_BYTES_OUT], "BYTES_OUT", "Bytes out", "%10.0f", 0, 0, 0, 0);
+    IUFillNumber(&LinkCountersN[COUNT_RESYNCS], "RESYNCS", "Resyncs", "%10.0f", 0, 0, 0, 0);
+    IUFillNumberVector(&LinkCountersNP, LinkCountersN, 7, getDeviceName(), "LINK_COUNTERS", "Link Counters", DIAGNOSTICS_TAB,
+                       IP_RO, 60, IPS_IDLE);
+
+    // Round trip milliseconds, median and p99 for each type of request
+    for (int type = InoLink::LATENCY_CON; type < InoLink::LATENCY_TYPES; type++)
+    {
+        const char *command = inoCommandNames[INO_CMD_CON + type];
+        char name[MAXINDINAME];
+        char label[MAXINDILABEL];
+        snprintf(name, sizeof(name), "%s_P50", command);
+        snprintf(label, sizeof(label), "%s median (ms)", command);
+        IUFillNumber(&LinkLatencyN[2 * type], name, label, "%7.2f", 0, 0, 0, 0);
+        snprintf(name, sizeof(name), "%s_P99", command);
+        snprintf(label, sizeof(label), "%s p99 (ms)", command);
+        IUFillNumber(&LinkLatencyN[2 * type + 1], name, label, "%7.2f", 0, 0, 0, 0);
+    }
+    IUFillNumberVector(&LinkLatencyNP, LinkLatencyN, 6, getDeviceName(), "LINK_LATENCY", "Link Latency", DIAGNOSTICS_TAB,
+                       IP_RO, 60, IPS_IDLE);
+
+    IUFillSwitch(&CloseAllS[0], "CLOSE_ALL", "Close all roofs", ISS_OFF);
+    IUFillSwitchVector(&CloseAllSP, CloseAllS, 1, getDeviceName(), "ROOF_CLOSE_ALL", "All Roofs", MAIN_CONTROL_TAB, IP_RW,
+                       ISR_ATMOST1, 0, IPS_IDLE);
+
+    // Keeping DTR up between connections stops the Arduino resetting each time the port is opened
+    IUFillSwitch(&ResetS[RESET_ON_CONNECT], "RESET_ON_CONNECT", "On connect", ISS_ON);
+    IUFillSwitch(&ResetS[RESET_NEVER], "RESET_NEVER", "Never", ISS_OFF);
+    IUFillSwitchVector(&ResetSP, ResetS, 2, getDeviceName(), "CONTROLLER_RESET", "Controller Reset", CONNECTION_TAB, IP_RW,
+                       ISR_1OFMANY, 0, IPS_IDLE);
+
+    // Simulation mode only, the simulated roof and link run this many times faster than real time
+    IUFillNumber(&SimClockN[0], "SIM_TIME_SCALE", "Time scale (x)", "%5.0f", 1, 1000, 1, 1);
+    IUFillNumberVector(&SimClockNP, SimClockN, 1, getDeviceName(), "SIMULATION_CLOCK", "Simulation Clock", SIMULATION_TAB,
+                       IP_RW, 60, IPS_IDLE);
+
+    IUFillSwitch(&SimFaultS[InoSim::FAULT_STUCK_SWITCH], "FAULT_STUCK_SWITCH", "Stuck switches", ISS_OFF);
+    IUFillSwitch(&SimFaultS[InoSim::FAULT_BOTH_SWITCHES], "FAULT_BOTH_SWITCHES", "Both switches on", ISS_OFF);
+    IUFillSwitch(&SimFaultS[InoSim::FAULT_DROP_RESPONSE], "FAULT_DROP_RESPONSE", "Drop responses", ISS_OFF);
+    IUFillSwitch(&SimFaultS[InoSim::FAULT_NAK], "FAULT_NAK", "Reject commands", ISS_OFF);
+    IUFillSwitch(&SimFaultS[InoSim::FAULT_SLOW_LINK], "FAULT_SLOW_LINK", "Slow link", ISS_OFF);
+    IUFillSwitchVector(&SimFaultSP, SimFaultS, InoSim::FAULTS, getDeviceName(), "SIMULATION_FAULTS", "Simulated Faults",
+                       SIMULATION_TAB, IP_RW, ISR_NOFMANY, 0, IPS_IDLE);
+
     SetParkDataType(PARK_NONE);
     addAuxControls(); // This is for standard controls not the local auxiliary switch
     return true;
@@ -172,27 +397,44 @@ bool RollOffNano::Handshake()
     bool status = false;
 
     LOGF_DEBUG("Driver id: %s", VERSION_ID);
-    if (PortFD <= 0)
+    if (isSimulation())
+    {
+        status = simulatedContact();
+        if (!status)
+            LOG_ERROR("Unable to contact the simulated roof controller");
+    }
+    else if (PortFD <= 0)
         DEBUG(INDI::Logger::DBG_WARNING, "The connection port has not been established");
     else
     {
-        if (!(status = initialContact()))
-        {
-            DEBUG(INDI::Logger::DBG_WARNING, "Initial controller contact failed, retrying");
-            msSleep(1000); // In case it is a Arduino still resetting from upload
-            status = initialContact();
-        }
+        InoContact contact {};
+
+        inoLink.setDeviceName(getDeviceName());
+        portRate = inoGetBaudRate(PortFD);
+        status = contactRoof(inoLink, PortFD, ResetS[RESET_ON_CONNECT].s == ISS_ON, &contact);
         if (!status)
             LOG_ERROR("Unable to contact the roof controller");
+        applyContact(contact);
     }
+    recordConnectTime();
     return status;
 }
 
+void RollOffNano::recordConnectTime()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    LinkN[LINK_CONNECT].value = (now.tv_sec - connectStart.tv_sec) * 1000.0 + (now.tv_nsec - connectStart.tv_nsec) / 1e6;
+    LOGF_DEBUG("Roof controller connect took %.0f ms", LinkN[LINK_CONNECT].value);
+}
+
 /**************************************************************************************
 ** Client is asking us to establish connection to the device
 ***************************************************************************************/
 bool RollOffNano::Connect()
 {
+    clock_gettime(CLOCK_MONOTONIC, &connectStart); // Including opening the port
     bool status = INDI::Dome::Connect();
     return status;
 }
@@ -202,6 +444,9 @@ bool RollOffNano::Connect()
 ***************************************************************************************/
 bool RollOffNano::Disconnect()
 {
+    stopReconnect();
+    stopLink();
+    closePort();
     bool status = INDI::Dome::Disconnect();
     return status;
 }
@@ -225,13 +470,44 @@ bool RollOffNano::updateProperties()
             DEBUG(INDI::Logger::DBG_SESSION, "Dome parking data was not obtained");
         }
         defineProperty(&RoofStatusLP); // All the roof status lights
+        defineProperty(&RoofPositionNP);
         defineProperty(&RoofTimeoutNP);
+        updateTravelStatus();
+        defineProperty(&RoofTravelNP);
+        defineProperty(&LinkNP);
+        updateLinkStats(inoLink.stats());
+        defineProperty(&LinkCountersNP);
+        defineProperty(&LinkLatencyNP);
+        if (isSimulation())
+        {
+            defineProperty(&SimClockNP);
+            defineProperty(&SimFaultSP);
+        }
+        startLink();
         setupConditions();
     }
     else
     {
+        stopLink();
+        if (publishTimerID >= 0)
+        {
+            IERmTimer(publishTimerID);
+            publishTimerID = -1;
+        }
+        if (positionTimerID >= 0)
+        {
+            IERmTimer(positionTimerID);
+            positionTimerID = -1;
+        }
         deleteProperty(RoofStatusLP.name); // Delete the roof status lights
+        deleteProperty(RoofPositionNP.name);
         deleteProperty(RoofTimeoutNP.name);
+        deleteProperty(RoofTravelNP.name);
+        deleteProperty(LinkNP.name);
+        deleteProperty(LinkCountersNP.name);
+        deleteProperty(LinkLatencyNP.name);
+        deleteProperty(SimClockNP.name);
+        deleteProperty(SimFaultSP.name);
     }
     return true;
 }
@@ -241,7 +517,11 @@ bool RollOffNano::updateProperties()
 *********************************************************************************************/
 bool RollOffNano::setupConditions()
 {
-    updateRoofStatus();
+    // Switches as read during the handshake, the simulated controller is asked for them
+    if (isSimulation())
+        updateRoofStatus();
+    else
+        applyRoofStatus(fullyOpenedLimitSwitch == ISS_ON, fullyClosedLimitSwitch == ISS_ON);
     Dome::DomeState curState = getDomeState();
     switch (curState)
     {
@@ -336,24 +616,98 @@ bool RollOffNano::setupConditions()
 
 /********************************************************************************************
 ** Client has changed the state of a switch, update
-********************************************************************************************
+********************************************************************************************/
 bool RollOffNano::ISNewSwitch(const char *dev, const char *name, ISState *states, char *names[], int n)
 {
-    bool switchOn = false;
-    // Make sure the call is for our device
     if (dev != nullptr && strcmp(dev, getDeviceName()) == 0)
     {
+        if (!strcmp(CloseAllSP.name, name))
+        {
+            CloseAllSP.s = IPS_OK;
+            IUResetSwitch(&CloseAllSP);
+            IDSetSwitch(&CloseAllSP, nullptr);
+            closeAllRoofs();
+            return true;
+        }
+        if (!strcmp(ResetSP.name, name))
+        {
+            IUUpdateSwitch(&ResetSP, states, names, n);
+            ResetSP.s = IPS_OK;
+            IDSetSwitch(&ResetSP, nullptr);
+            if (isConnected() && !isSimulation() && !reconnecting())
+                inoSetHangup(PortFD, ResetS[RESET_ON_CONNECT].s == ISS_ON);
+            return true;
+        }
+        if (!strcmp(SimFaultSP.name, name))
+        {
+            IUUpdateSwitch(&SimFaultSP, states, names, n);
+            for (int fault = 0; fault < InoSim::FAULTS; fault++)
+                inoSim.setFault(fault, SimFaultS[fault].s == ISS_ON);
+            SimFaultSP.s = IUFindOnSwitch(&SimFaultSP) != nullptr ? IPS_ALERT : IPS_OK;
+            IDSetSwitch(&SimFaultSP, nullptr);
+            return true;
+        }
+        if (!strcmp(AutoTimeoutSP.name, name))
+        {
+            IUUpdateSwitch(&AutoTimeoutSP, states, names, n);
+            AutoTimeoutSP.s = IPS_OK;
+            IDSetSwitch(&AutoTimeoutSP, nullptr);
+            updateTravelStatus();
+            return true;
+        }
     }
+
     return INDI::Dome::ISNewSwitch(dev, name, states, names, n);
 }
-*/
+
+bool RollOffNano::ISNewText(const char *dev, const char *name, char *texts[], char *names[], int n)
+{
+    if (dev != nullptr && strcmp(dev, getDeviceName()) == 0)
+    {
+        if (!strcmp(RoofTravelTP.name, name))
+        {
+            IUUpdateText(&RoofTravelTP, texts, names, n);
+            roofTravel[DOME_CW].fromText(RoofTravelT[DOME_CW].text);
+            roofTravel[DOME_CCW].fromText(RoofTravelT[DOME_CCW].text);
+            RoofTravelTP.s = IPS_OK;
+            updateTravelStatus();
+            IDSetText(&RoofTravelTP, nullptr);
+            return true;
+        }
+    }
+
+    return INDI::Dome::ISNewText(dev, name, texts, names, n);
+}
+
+/*
+ * Set the status lights from the switches when they are fresh, otherwise ask the controller for them
+ * and set the lights once they arrive.
+ */
 void RollOffNano::updateRoofStatus()
 {
     bool openedState = false;
     bool closedState = false;
 
-    getFullOpenedLimitSwitch(&openedState);
-    getFullClosedLimitSwitch(&closedState);
+    if (!switchesCached())
+    {
+        pollRoofSwitches();
+        return;
+    }
+    else
+    {
+        openedState = (fullyOpenedLimitSwitch == ISS_ON);
+        closedState = (fullyClosedLimitSwitch == ISS_ON);
+    }
+    applyRoofStatus(openedState, closedState);
+}
+
+/********************************************************************************************
+** Set the roof status lights from the limit switches and the motion in progress
+********************************************************************************************/
+void RollOffNano::applyRoofStatus(bool openedState, bool closedState)
+{
+    IPState previous[] = { RoofStatusL[ROOF_STATUS_OPENED].s, RoofStatusL[ROOF_STATUS_CLOSED].s,
+                           RoofStatusL[ROOF_STATUS_MOVING].s, RoofStatusLP.s };
 
     if (!openedState && !closedState && !roofOpening && !roofClosing)
         DEBUG(INDI::Logger::DBG_WARNING, "Roof stationary, neither opened or closed, adjust to match PARK button");
@@ -405,11 +759,69 @@ void RollOffNano::updateRoofStatus()
         RoofStatusLP.s = IPS_ALERT;
     }
 
-    IDSetLight(&RoofStatusLP, nullptr);
+    if (previous[0] != RoofStatusL[ROOF_STATUS_OPENED].s || previous[1] != RoofStatusL[ROOF_STATUS_CLOSED].s ||
+        previous[2] != RoofStatusL[ROOF_STATUS_MOVING].s || previous[3] != RoofStatusLP.s)
+        markChanged(PUBLISH_STATUS);
+    updateRoofPosition();
+}
+
+/*
+ * Percent open, estimated from the time since the move started and the median travel time in its
+ * direction without asking the controller anything. The limit switches correct it, the roof is
+ * at 0 or 100 once the switch it was heading for is on and short of it until then, however long
+ * the move is taking. Until a move in a direction has been timed the position holds where it was.
+ */
+void RollOffNano::updateRoofPosition()
+{
+    double previous[] = { RoofPositionN[POSITION_OPEN].value, RoofPositionN[POSITION_REMAINING].value };
+    IPState previousState = RoofPositionNP.s;
+    bool opened = (fullyOpenedLimitSwitch == ISS_ON);
+    bool closed = (fullyClosedLimitSwitch == ISS_ON);
+    bool moving = (DomeMotionSP.s == IPS_BUSY) && (roofOpening || roofClosing);
+
+    RoofPositionN[POSITION_REMAINING].value = 0;
+    if ((opened && !closed && (!moving || roofOpening)) || (closed && !opened && (!moving || roofClosing)))
+    {
+        RoofPositionN[POSITION_OPEN].value = opened ? 100 : 0;
+        RoofPositionNP.s = IPS_OK;
+    }
+    else if (moving)
+    {
+        int dir = roofOpening ? DOME_CW : DOME_CCW;
+        double expected = roofTravel[dir].percentile(0.5);
+        double moved = (expected > 0) ? 100 * (MotionRequest - CalcTimeLeft(MotionStart)) / expected : 0;
+        double position = roofOpening ? std::min(positionStart + moved, (double)POSITION_LIMIT) :
+                                        std::max(positionStart - moved, 100.0 - POSITION_LIMIT);
+
+        RoofPositionN[POSITION_OPEN].value = position;
+        if (expected > 0)
+            RoofPositionN[POSITION_REMAINING].value = expected * (roofOpening ? 100 - position : position) / 100;
+        RoofPositionNP.s = IPS_BUSY;
+    }
+    else
+        RoofPositionNP.s = (roofTimedOut != EXPIRED_CLEAR) ? IPS_ALERT : IPS_IDLE; // Stopped short of a switch
+
+    if (previous[0] != RoofPositionN[POSITION_OPEN].value || previous[1] != RoofPositionN[POSITION_REMAINING].value ||
+        previousState != RoofPositionNP.s)
+        markChanged(PUBLISH_POSITION);
+}
+
+// Keep the estimate moving with the roof, a local timer with no controller traffic
+void RollOffNano::positionTick()
+{
+    positionTimerID = -1;
+    updateRoofPosition();
+    if (RoofPositionNP.s == IPS_BUSY)
+        positionTimerID = IEAddTimer(timerDelay(POSITION_UPDATE), positionHelper, this);
+}
+
+void RollOffNano::positionHelper(void *context)
+{
+    static_cast<RollOffNano *>(context)->positionTick();
 }
 
 /********************************************************************************************
-** Each 1 second timer tick, if roof active
+** Timer tick, scheduled by motionPollDelay() if roof active
 ********************************************************************************************/
 void RollOffNano::TimerHit()
 {
@@ -418,152 +830,399 @@ void RollOffNano::TimerHit()
     if (!isConnected())
         return; //  No need to reset timer if we are not connected anymore
 
-    if (isSimulation())
+    // With switch events the controller reports changes itself, only poll it without them
+    if ((!switchEvents || isSimulation()) && !reconnecting())
+        updateRoofStatus();
+
+    if (checkRoofMotion(timeleft))
     {
-        if (timeleft - 5 <= 0) // Use timeout approaching to set faux switch indicator
-        {
-            if (DomeMotionS[DOME_CW].s == ISS_ON) // Opening
-            {
-                simRoofOpen = true;
-                simRoofClosed = false;
-            }
-            else if (DomeMotionS[DOME_CCW].s == ISS_ON) // Closing
-            {
-                simRoofClosed = true;
-                simRoofOpen = false;
-            }
-        }
+        if (switchesCached())
+            confirmRoofMotion(); // Otherwise done as the polled switches arrive
+        // The arrival comes as an event, reads through the move keep the controller from
+        // taking a quiet link as a closed port and dropping back to its starting rate
+        if (switchEvents && !isSimulation() && !reconnecting())
+            pollRoofSwitches();
+        delay = motionPollDelay(timeleft); // opening or closing active
+    }
+    else if (switchEvents && !isSimulation() && !reconnecting())
+    {
+        applyRoofStatus(fullyOpenedLimitSwitch == ISS_ON, fullyClosedLimitSwitch == ISS_ON);
+        // Idle until an event arrives, an occasional read shows the link is still alive
+        pollRoofSwitches();
+        delay = 1000 * HEARTBEAT_INTERVAL;
+    }
+
+    // WiFi and USB links can drop, keep trying to get the controller back rather than give up on it
+    bool linked = inoWorker.isRunning() || (isSimulation() && contactEstablished);
+    if (linked && (linkErrors > MAX_CNTRL_COM_ERR || missedReads >= HEARTBEAT_MISSES))
+    {
+        LOG_ERROR("Too many errors communicating with Arduino, reconnecting");
+        startReconnect();
     }
 
-    updateRoofStatus();
+    // Even when no roof movement requested, will come through occasionally. Use timer to update roof status
+    // in case roof has been operated externally by a remote control, locks applied...
+    scheduleTimer(delay);
+}
+
+/*
+ * One timer drives the status updates, starting a new one replaces any still waiting
+ */
+void RollOffNano::scheduleTimer(uint32_t delay)
+{
+    if (statusTimerID >= 0)
+        RemoveTimer(statusTimerID);
+    statusTimerID = SetTimer(timerDelay(delay));
+}
+
+/*
+ * Timers are set in the time the roof moves by. In simulation that runs faster than real time.
+ */
+uint32_t RollOffNano::timerDelay(uint32_t delay)
+{
+    return isSimulation() ? inoSim.realDelay(delay) : delay;
+}
+
+void RollOffNano::clockNow(struct timespec *now)
+{
+    if (isSimulation())
+        inoSim.now(now);
+    else
+        clock_gettime(CLOCK_MONOTONIC, now);
+}
+
+/********************************************************************************************
+** See if a roof opening or closing has reached its limit switch or run out of time.
+** Return true while the motion is still in progress.
+********************************************************************************************/
+bool RollOffNano::checkRoofMotion(double timeleft)
+{
+    if (DomeMotionSP.s != IPS_BUSY)
+        return false;
+
+    // Abort called stop movement.
+    if (MotionRequest < 0)
+    {
+        DEBUG(INDI::Logger::DBG_WARNING, "Roof motion is stopped");
+        setDomeState(DOME_IDLE);
+        return false;
+    }
 
-    if (DomeMotionSP.s == IPS_BUSY)
+    // Roll off is opening
+    if (DomeMotionS[DOME_CW].s == ISS_ON)
     {
-        // Abort called stop movement.
-        if (MotionRequest < 0)
+        if (fullyOpenedLimitSwitch == ISS_ON)
         {
-            DEBUG(INDI::Logger::DBG_WARNING, "Roof motion is stopped");
-            setDomeState(DOME_IDLE);
+            DEBUG(INDI::Logger::DBG_DEBUG, "Roof is open");
+            recordTravelTime(DOME_CW, travelTime(DOME_CW, MotionRequest - timeleft));
+            SetParked(false);
         }
-        else
+        // See if time to open has expired.
+        else if (timeleft <= 0)
         {
-            // Roll off is opening
-            if (DomeMotionS[DOME_CW].s == ISS_ON)
-            {
-                if (fullyOpenedLimitSwitch == ISS_ON)
-                {
-                    DEBUG(INDI::Logger::DBG_DEBUG, "Roof is open");
-                    SetParked(false);
-                }
-                // See if time to open has expired.
-                else if (timeleft <= 0)
-                {
-                    LOG_WARN("Time allowed for opening the roof has expired?");
-                    setDomeState(DOME_IDLE);
-                    roofOpening = false;
-                    roofTimedOut = EXPIRED_OPEN;
-                }
-                else
-                {
-                    delay = 1000; // opening active
-                }
-            }
-            // Roll Off is closing
-            else if (DomeMotionS[DOME_CCW].s == ISS_ON)
-            {
-                if (fullyClosedLimitSwitch == ISS_ON)
-                {
-                    DEBUG(INDI::Logger::DBG_DEBUG, "Roof is closed");
-                    SetParked(true);
-                }
-                // See if time to open has expired.
-                else if (timeleft <= 0)
-                {
-                    LOG_WARN("Time allowed for closing the roof has expired?");
-                    setDomeState(DOME_IDLE);
-                    roofClosing = false;
-                    roofTimedOut = EXPIRED_CLOSE;
-                }
-                else
-                {
-                    delay = 1000; // closing active
-                }
-            }
+            LOG_WARN("Time allowed for opening the roof has expired?");
+            setDomeState(DOME_IDLE);
+            roofOpening = false;
+            roofTimedOut = EXPIRED_OPEN;
         }
+        else
+            return true;
     }
-
-    // Added to highlight WiFi issues, not able to recover lost connection without a reconnect
-    if (communicationErrors > MAX_CNTRL_COM_ERR)
+    // Roll Off is closing
+    else if (DomeMotionS[DOME_CCW].s == ISS_ON)
     {
-        LOG_ERROR("Too many errors communicating with Arduino");
-        LOG_ERROR("Try a fresh connect. Check communication equipment and operation of Arduino controller.");
-        INDI::Dome::Disconnect();
-        initProperties();
-        communicationErrors = 0;
+        if (fullyClosedLimitSwitch == ISS_ON)
+        {
+            DEBUG(INDI::Logger::DBG_DEBUG, "Roof is closed");
+            recordTravelTime(DOME_CCW, travelTime(DOME_CCW, MotionRequest - timeleft));
+            SetParked(true);
+        }
+        // See if time to open has expired.
+        else if (timeleft <= 0)
+        {
+            LOG_WARN("Time allowed for closing the roof has expired?");
+            setDomeState(DOME_IDLE);
+            roofClosing = false;
+            roofTimedOut = EXPIRED_CLOSE;
+        }
+        else
+            return true;
     }
-
-    // Even when no roof movement requested, will come through occasionally. Use timer to update roof status
-    // in case roof has been operated externally by a remote control, locks applied...
-    SetTimer(delay);
+    return false;
 }
 
-float RollOffNano::CalcTimeLeft(timeval start)
+float RollOffNano::CalcTimeLeft(timespec start)
 {
     double timesince;
     double timeleft;
-    struct timeval now
+    struct timespec now
     {
         0, 0
     };
-    gettimeofday(&now, nullptr);
+    clockNow(&now);
 
-    timesince =
-        (double)(now.tv_sec * 1000.0 + now.tv_usec / 1000) - (double)(start.tv_sec * 1000.0 + start.tv_usec / 1000);
-    timesince = timesince / 1000;
+    timesince = (double)(now.tv_sec - start.tv_sec) + (double)(now.tv_nsec - start.tv_nsec) / 1e9;
     timeleft = MotionRequest - timesince;
     return timeleft;
 }
 
-bool RollOffNano::saveConfigItems(FILE *fp)
+/*
+ * Time until the next look at a moving roof. Nothing is expected to change until the roof nears
+ * the end of its usual travel, so polling is held off until then and runs quickly from there,
+ * easing off again if the roof is late. With switch events only the timeout needs checking, along
+ * with a heartbeat read.
+ */
+uint32_t RollOffNano::motionPollDelay(double timeleft)
 {
-    bool status = INDI::Dome::saveConfigItems(fp);
-    IUSaveConfigNumber(fp, &RoofTimeoutNP);
-    return status;
+    int dir = (DomeMotionS[DOME_CW].s == ISS_ON) ? DOME_CW : DOME_CCW;
+    double expected = roofTravel[dir].percentile(0.5);
+    double untilTimeout = std::max(timeleft, 0.0) * 1000 + ARRIVAL_POLL;
+    double delay;
+
+    if (switchEvents && !isSimulation())
+        delay = std::min(untilTimeout, 1000.0 * HEARTBEAT_INTERVAL);
+    else if (expected <= 0)
+        delay = MOTION_POLL;
+    else
+    {
+        double window = ARRIVAL_WINDOW + expected / 20;
+        double untilArrival = expected - (MotionRequest - timeleft);
+        if (untilArrival > window)
+            delay = (untilArrival - window) * 1000;
+        else
+            delay = std::min(ARRIVAL_POLL + std::max(-untilArrival, 0.0) * 250, (double)MOTION_POLL);
+    }
+    if (!motionConfirmed)
+        delay = std::min(delay, (double)MOTION_CONFIRM);
+    // Check the timeout as soon as it expires
+    return (uint32_t)std::max(std::min(delay, untilTimeout), (double)ARRIVAL_POLL);
 }
 
 /*
- * Direction: DOME_CW Clockwise = Open; DOME-CCW Counter clockwise = Close
- * Operation: MOTION_START, | MOTION_STOP
+ * The roof was set moving on the switch states held at the time, once fresh ones are in make
+ * sure it has left the limit switch it started from.
  */
-IPState RollOffNano::Move(DomeDirection dir, DomeMotionCommand operation)
+void RollOffNano::confirmRoofMotion()
 {
-    updateRoofStatus();
-    if (operation == MOTION_START)
+    if (motionConfirmed)
+        return;
+    motionConfirmed = true;
+    if (roofOpening && fullyClosedLimitSwitch == ISS_ON)
+        LOG_WARN("Roof has not left the closed position since it was asked to open");
+    else if (roofClosing && fullyOpenedLimitSwitch == ISS_ON)
+        LOG_WARN("Roof has not left the opened position since it was asked to close");
+}
+
+/*
+ * Seconds the roof took to reach the switch that ended its move, observed being when the driver saw
+ * it there. A poll only sees the roof arrive some time after it did, the controller's time for the
+ * switch change is used instead when there is one from this move.
+ */
+double RollOffNano::travelTime(int dir, double observed)
+{
+    const struct timespec &edge = switchEdge[dir];
+    double seconds = (double)(edge.tv_sec - MotionStart.tv_sec) + (double)(edge.tv_nsec - MotionStart.tv_nsec) / 1e9;
+
+    if (!switchEdges || seconds <= 0 || seconds > observed)
+        return observed;
+    return seconds;
+}
+
+/*
+ * Add a completed move to the travel history of its direction and keep it in the configuration.
+ * A run of moves slower than usual is reported as the drive may be wearing or binding.
+ */
+void RollOffNano::recordTravelTime(int dir, double seconds)
+{
+    const char *direction = (dir == DOME_CW) ? "open" : "close";
+
+    if (seconds <= 0 || isSimulation())
+        return;
+    roofTravel[dir].record(seconds);
+    LOGF_DEBUG("Roof took %.1f seconds to %s", seconds, direction);
+
+    double usual = roofTravel[dir].percentile(0.5);
+    double recent = roofTravel[dir].recentMedian();
+    RoofTravelNP.s = IPS_OK;
+    if (roofTravel[dir].count() >= 2 * TRAVEL_RECENT && recent > usual * TRAVEL_SLOWING)
     {
+        LOGF_WARN("Roof is taking %.1f seconds to %s against a usual %.1f, the drive may need attention", recent,
+                  direction, usual);
+        RoofTravelNP.s = IPS_ALERT;
+    }
+    updateTravelStatus();
+    saveConfig(true, RoofTravelTP.name);
+}
 
-        if (roofOpening)
+/*
+ * Seconds allowed for a move. Once enough moves have been seen it is the slowest usual move plus
+ * a margin, otherwise the timeout set in the options.
+ */
+double RollOffNano::motionTimeout(int dir)
+{
+    double p99 = roofTravel[dir].percentile(0.99);
+
+    if (AutoTimeoutS[AUTO_TIMEOUT_ENABLE].s != ISS_ON || roofTravel[dir].count() < TRAVEL_MIN_MOVES)
+        return RoofTimeoutN[0].value;
+    return p99 + std::max((double)TRAVEL_MARGIN, p99 / 10);
+}
+
+void RollOffNano::updateTravelStatus()
+{
+    char history[TRAVEL_SAMPLES * 8];
+    bool changed = false;
+    bool historyChanged = false;
+
+    for (int dir = DOME_CW; dir <= DOME_CCW; dir++)
+    {
+        int base = (dir == DOME_CW) ? TRAVEL_OPEN_P50 : TRAVEL_CLOSE_P50;
+        double values[] = { roofTravel[dir].percentile(0.5), roofTravel[dir].percentile(0.99), motionTimeout(dir) };
+        for (int i = 0; i < 3; i++)
         {
-            LOG_WARN("Roof is in process of opening, wait for completion or abort current operation");
-            return IPS_OK;
+            changed = changed || RoofTravelN[base + i].value != values[i];
+            RoofTravelN[base + i].value = values[i];
         }
-        if (roofClosing)
+        roofTravel[dir].toText(history, sizeof(history));
+        if (strcmp(history, RoofTravelT[dir].text) != 0)
         {
-            LOG_WARN("Roof is in process of closing, wait for completion or abort current operation");
-            return IPS_OK;
+            IUSaveText(&RoofTravelT[dir], history);
+            historyChanged = true;
         }
+    }
+    if (changed)
+        markChanged(PUBLISH_TRAVEL);
+    if (historyChanged)
+        markChanged(PUBLISH_HISTORY);
+}
 
-        // Open Roof
-        // DOME_CW --> OPEN. If we are asked to "open" while we are fully opened as the
-        // limit switch indicates, then we simply return false.
-        if (dir == DOME_CW)
+/*
+ * Send a changed property to clients, unless it was sent less than the minimum interval ago. Then
+ * it is sent once the interval is up, with whatever further changes it has had by then.
+ */
+void RollOffNano::markChanged(int property)
+{
+    publishDirty[property] = true;
+    if (publishTimerID < 0)
+        publishChanges();
+}
+
+void RollOffNano::publishChanges()
+{
+    struct timespec now;
+    double wait = 0;
+
+    publishTimerID = -1;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for (int property = 0; property < PUBLISH_PROPERTIES; property++)
+    {
+        double since = (now.tv_sec - publishedAt[property].tv_sec) * 1000.0 +
+                       (now.tv_nsec - publishedAt[property].tv_nsec) / 1e6;
+        if (!publishDirty[property])
+            continue;
+        if (since < PublishN[0].value)
         {
-            if (fullyOpenedLimitSwitch == ISS_ON)
-            {
-                LOG_WARN("DOME_CW directive received but roof is already fully opened");
-                SetParked(false);
-                return IPS_ALERT;
-            }
-            // getWeatherState is no longer available
+            wait = std::max(wait, PublishN[0].value - since);
+            continue;
+        }
+        publishDirty[property] = false;
+        publishedAt[property] = now;
+        if (property == PUBLISH_HISTORY)
+            IDSetText(&RoofTravelTP, nullptr); // An option, defined whether connected or not
+        if (!isConnected())
+            continue;
+        if (property == PUBLISH_STATUS)
+            IDSetLight(&RoofStatusLP, nullptr);
+        else if (property == PUBLISH_TRAVEL)
+            IDSetNumber(&RoofTravelNP, nullptr);
+        else if (property == PUBLISH_DIAGNOSTICS)
+        {
+            IDSetNumber(&LinkCountersNP, nullptr);
+            IDSetNumber(&LinkLatencyNP, nullptr);
+        }
+        else if (property == PUBLISH_POSITION)
+            IDSetNumber(&RoofPositionNP, nullptr);
+    }
+    if (wait > 0)
+        publishTimerID = IEAddTimer((int)std::ceil(wait), publishHelper, this);
+}
+
+void RollOffNano::publishHelper(void *context)
+{
+    static_cast<RollOffNano *>(context)->publishChanges();
+}
+
+/*
+ * Counters and latencies as of the last result from the link. Timeouts since the last update
+ * show as an alert on the counters.
+ */
+void RollOffNano::updateLinkStats(const InoLink::Stats &stats)
+{
+    double counters[] = { (double)stats.transactions, (double)stats.timeouts, (double)stats.naks, (double)stats.malformed,
+                          (double)stats.bytesIn, (double)stats.bytesOut, (double)stats.resyncs };
+    bool changed = false;
+
+    LinkCountersNP.s = (stats.timeouts > LinkCountersN[COUNT_TIMEOUTS].value) ? IPS_ALERT : IPS_OK;
+    for (int i = COUNT_TRANSACTIONS; i <= COUNT_RESYNCS; i++)
+    {
+        changed = changed || LinkCountersN[i].value != counters[i];
+        LinkCountersN[i].value = counters[i];
+    }
+    for (int type = InoLink::LATENCY_CON; type < InoLink::LATENCY_TYPES; type++)
+    {
+        LinkLatencyN[2 * type].value = stats.latency[type].percentile(0.5);
+        LinkLatencyN[2 * type + 1].value = stats.latency[type].percentile(0.99);
+    }
+    LinkLatencyNP.s = IPS_OK;
+    if (changed)
+        markChanged(PUBLISH_DIAGNOSTICS);
+}
+
+bool RollOffNano::saveConfigItems(FILE *fp)
+{
+    bool status = INDI::Dome::saveConfigItems(fp);
+    IUSaveConfigNumber(fp, &RoofTimeoutNP);
+    IUSaveConfigNumber(fp, &SwitchCacheNP);
+    IUSaveConfigNumber(fp, &PublishNP);
+    IUSaveConfigSwitch(fp, &AutoTimeoutSP);
+    IUSaveConfigSwitch(fp, &ResetSP);
+    IUSaveConfigText(fp, &RoofTravelTP);
+    return status;
+}
+
+/*
+ * Direction: DOME_CW Clockwise = Open; DOME-CCW Counter clockwise = Close
+ * Operation: MOTION_START, | MOTION_STOP
+ */
+IPState RollOffNano::Move(DomeDirection dir, DomeMotionCommand operation)
+{
+    updateRoofStatus(); // Served from the switch cache when fresh, confirmed once moving
+
+    if (operation == MOTION_START)
+    {
+
+        if (roofOpening)
+        {
+            LOG_WARN("Roof is in process of opening, wait for completion or abort current operation");
+            return IPS_OK;
+        }
+        if (roofClosing)
+        {
+            LOG_WARN("Roof is in process of closing, wait for completion or abort current operation");
+            return IPS_OK;
+        }
+
+        // Open Roof
+        // DOME_CW --> OPEN. If we are asked to "open" while we are fully opened as the
+        // limit switch indicates, then we simply return false.
+        if (dir == DOME_CW)
+        {
+            if (fullyOpenedLimitSwitch == ISS_ON)
+            {
+                LOG_WARN("DOME_CW directive received but roof is already fully opened");
+                SetParked(false);
+                return IPS_ALERT;
+            }
+            // getWeatherState is no longer available
             // else if (getWeatherState() == IPS_ALERT)
             //{
             //    LOG_WARN("Weather conditions are in the danger zone. Cannot open roof");
@@ -613,10 +1272,14 @@ IPState RollOffNano::Move(DomeDirection dir, DomeMotionCommand operation)
             }
         }
         roofTimedOut = EXPIRED_CLEAR;
-        MotionRequest = (int)RoofTimeoutN[0].value;
-        LOGF_DEBUG("Roof motion timeout setting: %d", (int)MotionRequest);
-        gettimeofday(&MotionStart, nullptr);
-        SetTimer(1000);
+        MotionRequest = motionTimeout(dir);
+        LOGF_DEBUG("Roof motion timeout setting: %.1f", MotionRequest);
+        clockNow(&MotionStart);
+        motionConfirmed = false;
+        scheduleTimer(motionPollDelay(MotionRequest));
+        positionStart = RoofPositionN[POSITION_OPEN].value;
+        if (positionTimerID < 0)
+            positionTimerID = IEAddTimer(0, positionHelper, this);
         return IPS_BUSY;
     }
     return IPS_ALERT;
@@ -638,6 +1301,19 @@ IPState RollOffNano::Park()
         return IPS_ALERT;
 }
 
+/*
+ * Stop the roof where it is, the switch polls then show where that is. The position estimate
+ * is taken at the stop and settles on the next position tick.
+ */
+bool RollOffNano::Abort()
+{
+    updateRoofPosition();
+    MotionRequest = -1;
+    roofOpening = false;
+    roofClosing = false;
+    return roofAbort();
+}
+
 /*
  * Open Roof
  *
@@ -656,250 +1332,897 @@ IPState RollOffNano::UnPark()
 
 bool RollOffNano::getFullOpenedLimitSwitch(bool *switchState)
 {
-    if (isSimulation())
+    // As last read, refreshed for the next call when no longer fresh
+    if (!switchesValid)
     {
-        if (simRoofOpen)
-        {
-            fullyOpenedLimitSwitch = ISS_ON;
-            *switchState = true;
-        }
-        else
-        {
-            fullyOpenedLimitSwitch = ISS_OFF;
-            *switchState = false;
-        }
-        return true;
+        LOG_WARN("Unable to obtain from the controller whether or not the roof is opened");
+        pollRoofSwitches();
+        return false;
     }
+    *switchState = (fullyOpenedLimitSwitch == ISS_ON);
+    if (!switchesCached())
+        pollRoofSwitches();
+    return true;
+}
 
-    if (readRoofSwitch(ROOF_OPENED_SWITCH, switchState))
+bool RollOffNano::getFullClosedLimitSwitch(bool *switchState)
+{
+    // As last read, refreshed for the next call when no longer fresh
+    if (!switchesValid)
     {
-        if (*switchState)
-            fullyOpenedLimitSwitch = ISS_ON;
-        else
-            fullyOpenedLimitSwitch = ISS_OFF;
-        return true;
+        LOG_WARN("Unable to obtain from the controller whether or not the roof is closed");
+        pollRoofSwitches();
+        return false;
     }
-    else
+    *switchState = (fullyClosedLimitSwitch == ISS_ON);
+    if (!switchesCached())
+        pollRoofSwitches();
+    return true;
+}
+
+
+/*
+ * -------------------------------------------------------------------------------------------
+ *
+ */
+bool RollOffNano::roofOpen()
+{
+    return pushRoofButton(ROOF_OPEN_RELAY, true, false);
+}
+
+bool RollOffNano::roofClose()
+{
+    return pushRoofButton(ROOF_CLOSE_RELAY, true, false);
+}
+
+/*
+ * The stop goes ahead of everything waiting for the link and does not wait on a poll already sent.
+ * Whether a pulse would stop the roof or set it off again is left to the controller, which knows
+ * if the roof is still on its way and rejects the request otherwise.
+ */
+bool RollOffNano::roofAbort()
+{
+    InoJob job {};
+
+    if (!contactEstablished)
     {
-        LOG_WARN("Unable to obtain from the controller whether or not the roof is opened");
+        LOG_WARN("No contact with the roof controller has been established");
         return false;
     }
+    job.tag = JOB_ABORT;
+    InoWorker::addRequest(&job, "SET", ROOF_ABORT_RELAY, "ON");
+    clockNow(&abortStart);
+    switchesValid = false;
+    return postJob(job, true);
 }
 
-bool RollOffNano::getFullClosedLimitSwitch(bool *switchState)
+/*
+ * Once connected the link runs on the worker thread, the event loop only posts jobs to it and
+ * handles the results. Without a worker there is nothing to post to and the roof cannot be operated.
+ */
+void RollOffNano::startLink()
 {
-    if (isSimulation())
+    if (isSimulation() || inoWorker.isRunning())
+        return;
+    linkErrors = inoLink.errors();
+    if (!inoWorker.start(&inoLink))
     {
-        if (simRoofClosed)
-        {
-            fullyClosedLimitSwitch = ISS_ON;
-            *switchState = true;
-        }
-        else
-        {
-            fullyClosedLimitSwitch = ISS_OFF;
-            *switchState = false;
-        }
-        return true;
+        LOG_ERROR("Unable to start the roof controller link thread");
+        return;
     }
+    linkResultCallbackID = IEAddCallback(inoWorker.notifyFD(), linkResultHelper, this);
+}
 
-    if (readRoofSwitch(ROOF_CLOSED_SWITCH, switchState))
+void RollOffNano::stopLink()
+{
+    if (linkResultCallbackID >= 0)
     {
-        if (*switchState)
-            fullyClosedLimitSwitch = ISS_ON;
-        else
-            fullyClosedLimitSwitch = ISS_OFF;
-        return true;
+        IERmCallback(linkResultCallbackID);
+        linkResultCallbackID = -1;
     }
+    inoWorker.stop();
+    inoSim.clear();
+    if (simTimerID >= 0)
+    {
+        IERmTimer(simTimerID);
+        simTimerID = -1;
+    }
+    inoLink.setEventHandler(linkEventHelper, this);
+    inoLink.clearErrors();
+    linkErrors = 0;
+    missedReads = 0;
+    pollPending = false;
+    if (switchEventTimerID >= 0)
+    {
+        IERmTimer(switchEventTimerID);
+        switchEventTimerID = -1;
+    }
+}
+
+/*
+ * Record the switch change reported in an (EVT:switch:ON|OFF) frame. Acting on it is left to
+ * the event loop as it may have arrived in the middle of another request.
+ */
+void RollOffNano::handleSwitchEvent(const char *frame)
+{
+    InoFrame event;
+
+    LOGF_DEBUG("Event from roof controller: %s", frame);
+    if (!inoParseFrame(frame, strlen(frame), &event) || event.command != INO_CMD_EVT)
+        return;
+    if (event.target == INO_TARGET_OPENED)
+        fullyOpenedLimitSwitch = event.value.is("ON") ? ISS_ON : ISS_OFF;
+    else if (event.target == INO_TARGET_CLOSED)
+        fullyClosedLimitSwitch = event.value.is("ON") ? ISS_ON : ISS_OFF;
     else
+        return;
+    cacheSwitches();
+    if (switchEventTimerID < 0)
+        switchEventTimerID = IEAddTimer(0, processEventsHelper, this);
+}
+
+void RollOffNano::processSwitchEvents()
+{
+    switchEventTimerID = -1;
+    if (!isConnected())
+        return;
+    applyRoofStatus(fullyOpenedLimitSwitch == ISS_ON, fullyClosedLimitSwitch == ISS_ON);
+    checkRoofMotion(CalcTimeLeft(MotionStart));
+}
+
+/*
+ * The link has been lost with the roof in whatever state it was. The dome and park state are
+ * left as they are for the controller to confirm once it is back, a move in progress still
+ * times out if the controller does not return in time for it.
+ */
+void RollOffNano::startReconnect()
+{
+    stopLink();
+    contactEstablished = false;
+    RoofStatusLP.s = IPS_ALERT;
+    markChanged(PUBLISH_STATUS);
+    reconnectDelay = RECONNECT_FIRST;
+    reconnectTimerID = IEAddTimer(reconnectDelay, reconnectHelper, this);
+}
+
+void RollOffNano::stopReconnect()
+{
+    if (reconnectTimerID >= 0)
     {
-        LOG_WARN("Unable to obtain from the controller whether or not the roof is closed");
-        return false;
+        IERmTimer(reconnectTimerID);
+        reconnectTimerID = -1;
     }
+    stopContact();
 }
 
+// Waiting to try again or with a handshake under way
+bool RollOffNano::reconnecting() const
+{
+    return reconnectTimerID >= 0 || contactThread.joinable();
+}
 
 /*
- * -------------------------------------------------------------------------------------------
- *
+ * Reopen the port and run the handshake again. Against a real controller that takes seconds, so it
+ * runs on contactThread and the roof carries on from the switches it read once it is done.
  */
-bool RollOffNano::roofOpen()
+void RollOffNano::reconnect()
 {
+    reconnectTimerID = -1;
+    if (!isConnected())
+        return;
+    clock_gettime(CLOCK_MONOTONIC, &connectStart);
     if (isSimulation())
     {
-        return true;
+        serialConnection->Disconnect();
+        reconnected(serialConnection->Connect());
+        return;
     }
-    return pushRoofButton(ROOF_OPEN_RELAY, true, false);
+    closePort();
+    if (!startContact())
+        reconnected(false);
 }
 
-bool RollOffNano::roofClose()
+void RollOffNano::reconnected(bool status)
 {
-    if (isSimulation())
+    if (status)
     {
-        return true;
+        LOG_INFO("Reconnected to the roof controller");
+        startLink();
+        applyRoofStatus(fullyOpenedLimitSwitch == ISS_ON, fullyClosedLimitSwitch == ISS_ON);
+        markChanged(PUBLISH_STATUS);
+        checkRoofMotion(CalcTimeLeft(MotionStart));
+        scheduleTimer(0);
+        return;
     }
-    return pushRoofButton(ROOF_CLOSE_RELAY, true, false);
+    reconnectDelay = std::min(reconnectDelay * 2, RECONNECT_MAX);
+    LOGF_WARN("Unable to reconnect to the roof controller, trying again in %d seconds", reconnectDelay / 1000);
+    reconnectTimerID = IEAddTimer(reconnectDelay, reconnectHelper, this);
+}
+
+void RollOffNano::reconnectHelper(void *context)
+{
+    static_cast<RollOffNano *>(context)->reconnect();
 }
 
 /*
- * If unable to determine switch state due to errors, return false.
- * If no errors return true. Return in result true if switch and false if switch off.
+ * Start the handshake on its own thread rather than the link worker, whose jobs must not block as
+ * it serves every roof. The thread runs a copy of the link, taken back by contactFinished() with
+ * its counters, events it reads are dropped as the snapshot it takes covers them.
  */
-bool RollOffNano::readRoofSwitch(const char *roofSwitchId, bool *result)
+bool RollOffNano::startContact()
+{
+    if (pipe(contactPipe) < 0)
+    {
+        LOGF_ERROR("Unable to create the reconnect pipe: %s", strerror(errno));
+        return false;
+    }
+    fcntl(contactPipe[0], F_SETFL, fcntl(contactPipe[0], F_GETFL) | O_NONBLOCK);
+    contactLink = inoLink;
+    contactLink.setEventHandler(nullptr, nullptr);
+    contactFD = -1;
+    contactFound = {};
+    contactCallbackID = IEAddCallback(contactPipe[0], contactHelper, this);
+    contactThread = std::thread(&RollOffNano::runContact, this, std::string(serialConnection->port()), portRate,
+                                ResetS[RESET_ON_CONNECT].s == ISS_ON);
+    return true;
+}
+
+/*
+ * Drop a handshake under way, waiting for it to run out as it cannot be cut short
+ */
+void RollOffNano::stopContact()
+{
+    if (contactCallbackID >= 0)
+    {
+        IERmCallback(contactCallbackID);
+        contactCallbackID = -1;
+    }
+    if (contactThread.joinable())
+        contactThread.join();
+    for (int &fd : contactPipe)
+    {
+        if (fd >= 0)
+            close(fd);
+        fd = -1;
+    }
+    if (contactFD >= 0)
+    {
+        tty_disconnect(contactFD);
+        contactFD = -1;
+    }
+}
+
+// On contactThread, only contactLink, contactFD and contactFound are touched and lines logged are held
+void RollOffNano::runContact(std::string port, int rate, bool hangup)
+{
+    int fd = -1;
+
+    loggingTo = &contactFound;
+    if (tty_connect(port.c_str(), rate, 8, 0, 1, &fd) != TTY_OK)
+        logMessage(INDI::Logger::DBG_WARNING, "Unable to open %s to reconnect", port.c_str());
+    else if (!contactRoof(contactLink, fd, hangup, &contactFound))
+    {
+        tty_disconnect(fd);
+        fd = -1;
+    }
+    contactFD = fd;
+    if (write(contactPipe[1], "", 1) < 0)
+        logMessage(INDI::Logger::DBG_ERROR, "Unable to signal the end of the reconnect: %s", strerror(errno));
+}
+
+/*
+ * The handshake is done, the port it opened now belongs to the driver
+ */
+void RollOffNano::contactFinished()
 {
-    char readBuffer[MAXINOBUF];
-    char writeBuffer[MAXINOLINE];
     bool status;
 
+    contactThread.join();
+    inoLink = contactLink;
+    for (const auto &line : contactFound.log)
+        DEBUGF(line.first, "%s", line.second.c_str());
+    status = (contactFD >= 0);
+    if (status)
+    {
+        PortFD = reconnectFD = contactFD;
+        contactFD = -1;
+    }
+    stopContact();
+    applyContact(contactFound);
+    recordConnectTime();
+    reconnected(status);
+}
+
+void RollOffNano::contactHelper(int fd, void *context)
+{
+    INDI_UNUSED(fd);
+    static_cast<RollOffNano *>(context)->contactFinished();
+}
+
+/*
+ * Log from the handshake and the responses it evaluates. On contactThread the line is held in the
+ * contact, for contactFinished() to log on the event loop.
+ */
+void RollOffNano::logMessage(INDI::Logger::VerbosityLevel level, const char *format, ...)
+{
+    char line[MAXRBUF];
+    va_list args;
+
+    va_start(args, format);
+    vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    if (loggingTo != nullptr)
+        loggingTo->log.emplace_back(level, line);
+    else
+        DEBUGF(level, "%s", line);
+}
+
+/*
+ * Close the port, whether opened by serialConnection or by a reconnect
+ */
+void RollOffNano::closePort()
+{
+    if (reconnectFD >= 0)
+    {
+        tty_disconnect(reconnectFD);
+        reconnectFD = -1;
+    }
+    else
+        serialConnection->Disconnect();
+    PortFD = -1;
+}
+
+/*
+ * The worker has results waiting
+ */
+void RollOffNano::linkResultHelper(int fd, void *context)
+{
+    RollOffNano *driver = static_cast<RollOffNano *>(context);
+    InoResult result;
+
+    INDI_UNUSED(fd);
+    while (driver->inoWorker.next(&result))
+        driver->handleLinkResult(result);
+}
+
+void RollOffNano::handleLinkResult(const InoResult &result)
+{
+    linkErrors = result.errors;
+    updateLinkStats(result.stats);
+    switch (result.tag)
+    {
+    case INO_RESULT_EVENT:
+        handleSwitchEvent(result.responses[0]);
+        break;
+    case JOB_SWITCHES:
+        switchesPolled(result);
+        break;
+    case JOB_BUTTON:
+        buttonPushed(result);
+        break;
+    case JOB_ABORT:
+        roofAborted(result);
+        break;
+    }
+}
+
+/*
+ * Jobs go to the worker, or in simulation to the simulated controller with a timer to collect
+ * the results once they are due. It answers in the order jobs are posted, urgent or not.
+ */
+bool RollOffNano::postJob(const InoJob &job, bool urgent)
+{
+    if (!isSimulation())
+        return inoWorker.post(job, urgent);
+    inoSim.post(job);
+    if (simTimerID < 0)
+        simTimerID = IEAddTimer(inoSim.untilNext(), simulatedHelper, this);
+    return true;
+}
+
+void RollOffNano::simulatedResults()
+{
+    InoResult result;
+    int wait;
+
+    simTimerID = -1;
+    while (inoSim.next(&result))
+        handleLinkResult(result);
+    wait = inoSim.untilNext();
+    if (wait >= 0 && simTimerID < 0)
+        simTimerID = IEAddTimer(wait, simulatedHelper, this);
+}
+
+void RollOffNano::simulatedHelper(void *context)
+{
+    static_cast<RollOffNano *>(context)->simulatedResults();
+}
+
+void RollOffNano::linkEventHelper(const char *frame, void *context)
+{
+    static_cast<RollOffNano *>(context)->handleSwitchEvent(frame);
+}
+
+void RollOffNano::processEventsHelper(void *context)
+{
+    static_cast<RollOffNano *>(context)->processSwitchEvents();
+}
+
+/*
+ * Ask the worker for the opened and closed switches from a single (GET:ALL:0) request so they are a
+ * consistent snapshot. Controllers without it are sent both single requests without waiting in between.
+ * Polls go behind any commands waiting, and only one is waiting at a time.
+ */
+void RollOffNano::pollRoofSwitches()
+{
+    InoJob job {};
+
     if (!contactEstablished)
     {
         LOG_WARN("No contact with the roof controller has been established");
-        return false;
+        return;
+    }
+    if (pollPending)
+        return;
+    job.tag = JOB_SWITCHES;
+    if (switchSnapshot)
+    {
+        InoWorker::addRequest(&job, "GET", ROOF_ALL_SWITCHES, "0");
+        // While the roof moves, when it reached a switch matters more than when the poll saw it there
+        if (switchEdges && DomeMotionSP.s == IPS_BUSY)
+            InoWorker::addRequest(&job, "GET", ROOF_SWITCH_EDGES, "0");
     }
-    if (roofSwitchId == 0)
+    else
+    {
+        InoWorker::addRequest(&job, "GET", ROOF_OPENED_SWITCH, "0");
+        InoWorker::addRequest(&job, "GET", ROOF_CLOSED_SWITCH, "0");
+    }
+    pollPending = postJob(job, false);
+    if (!pollPending)
+        LOG_DEBUG("Unable to queue a switch request to the roof controller");
+}
+
+void RollOffNano::switchesPolled(const InoResult &result)
+{
+    bool openedState = false;
+    bool closedState = false;
+    bool status;
+
+    pollPending = false;
+    if (!isConnected())
+        return;
+    missedReads = result.ok[0] ? 0 : missedReads + 1;
+    if (switchSnapshot)
+    {
+        status = result.ok[0] && evaluateSnapshot(result.responses[0], &openedState, &closedState);
+        if (result.count > 1 && result.ok[1])
+            evaluateEdges(result.responses[1], switchEdge);
+    }
+    else
+    {
+        status = result.ok[0] && evaluateResponse(result.responses[0], &openedState);
+        status = result.ok[1] && evaluateResponse(result.responses[1], &closedState) && status;
+    }
+    if (status)
+    {
+        fullyOpenedLimitSwitch = openedState ? ISS_ON : ISS_OFF;
+        fullyClosedLimitSwitch = closedState ? ISS_ON : ISS_OFF;
+        cacheSwitches();
+    }
+    else
+        LOG_WARN("Unable to obtain from the controller whether or not the roof is opened or closed");
+    applyRoofStatus(openedState, closedState);
+    if (status && checkRoofMotion(CalcTimeLeft(MotionStart)))
+        confirmRoofMotion();
+}
+
+/*
+ * Read the opened and closed switches directly, only while the link is not yet running on the worker.
+ * If unable to obtain them due to errors, return false.
+ */
+bool RollOffNano::readRoofSwitches(InoLink &link, bool *openedState, bool *closedState)
+{
+    char readBuffer[MAXINOBUF];
+    int openedRequest;
+    int closedRequest;
+    bool status;
+
+    openedRequest = link.send("GET", ROOF_OPENED_SWITCH, "0");
+    closedRequest = link.send("GET", ROOF_CLOSED_SWITCH, "0");
+    status = (openedRequest >= 0) && link.await(openedRequest, readBuffer) && evaluateResponse(readBuffer, openedState);
+    status = (closedRequest >= 0) && link.await(closedRequest, readBuffer) && evaluateResponse(readBuffer, closedState) && status;
+    return status;
+}
+
+/*
+ * The switch states last read stand for SWITCH_CACHE milliseconds, or until a command is sent.
+ * With switch events the controller keeps them current so they stand until events stop.
+ */
+bool RollOffNano::switchesCached()
+{
+    struct timespec now;
+    double age;
+
+    if (!switchesValid)
+        return false;
+    if (switchEvents && !isSimulation())
+        return true;
+    clockNow(&now);
+    age = (now.tv_sec - switchesRead.tv_sec) * 1000.0 + (now.tv_nsec - switchesRead.tv_nsec) / 1e6;
+    return age < SwitchCacheN[0].value;
+}
+
+void RollOffNano::cacheSwitches()
+{
+    switchesValid = true;
+    clockNow(&switchesRead);
+}
+
+/*
+ * Evaluate the response to (GET:ALL:0), the value has a '1' or '0' per switch starting with OPENED, CLOSED.
+ */
+bool RollOffNano::evaluateSnapshot(const char *buff, bool *openedState, bool *closedState)
+{
+    InoFrame frame;
+    bool result = false;
+
+    if (!evaluateResponse(buff, &result, &frame) || (frame.value.len < 4))
+        return false;
+    *openedState = (frame.value.data[0] == '1');
+    *closedState = (frame.value.data[1] == '1');
+    return true;
+}
+
+/*
+ * Evaluate the response to (GET:EDGES:0), the milliseconds since each switch changed starting with
+ * OPENED, CLOSED. Taking them back from now gives when the opened and closed switches changed.
+ */
+bool RollOffNano::evaluateEdges(const char *buff, struct timespec edge[2])
+{
+    InoFrame frame;
+    bool result = false;
+    char ages[MAXINOBUF];
+    unsigned long age[2];
+    struct timespec now
+    {
+        0, 0
+    };
+
+    if (!evaluateResponse(buff, &result, &frame))
         return false;
-    memset(writeBuffer, 0, sizeof(writeBuffer));
-    strcpy(writeBuffer, "(GET:");
-    strcat(writeBuffer, roofSwitchId);
-    strcat(writeBuffer, ":0)");
-    if (!writeIno(writeBuffer))
+    snprintf(ages, sizeof(ages), "%.*s", (int)frame.value.len, frame.value.data);
+    if (sscanf(ages, "%lu,%lu", &age[0], &age[1]) != 2)
         return false;
-    memset(readBuffer, 0, sizeof(readBuffer));
-    if (!readIno(readBuffer))
+    clockNow(&now);
+    for (int i = 0; i < 2; i++)
+    {
+        long long ns = now.tv_sec * 1000000000LL + now.tv_nsec - age[i] * 1000000LL;
+        edge[i].tv_sec = ns / 1000000000LL;
+        edge[i].tv_nsec = ns % 1000000000LL;
+    }
+    return true;
+}
+
+/*
+ * The handshake over the port fd, moving it to the fastest rate both ends support. Between them the
+ * link and contact hold all it finds, so that a reconnect can run it off the event loop.
+ */
+bool RollOffNano::contactRoof(InoLink &link, int fd, bool hangup, InoContact *contact)
+{
+    link.setPort(fd);
+    inoSetHangup(fd, hangup);
+    if (!initialContact(link, contact))
         return false;
-    status = evaluateResponse(readBuffer, result);
-    return status;
+    contact->baud = negotiateBaudRate(link);
+    return true;
 }
 
 /*
- * See if the controller is running
+ * See if the controller is running and whether it tags responses with the sequence id of the request.
+ * Then find out if it can return all the switches in one request, say when they changed and send
+ * switch events, older controllers NAK these requests.
  */
-bool RollOffNano::initialContact(void)
+bool RollOffNano::initialContact(InoLink &link, InoContact *contact)
 {
     char readBuffer[MAXINOBUF];
     bool result = false;
+    int snapshotRequest;
+    int edgesRequest;
+    int eventsRequest;
+
+    link.reset();
+    if (!contactController(link, readBuffer) && !contactFasterRate(link, readBuffer))
+        return false;
+    link.setSequenced(strncmp(readBuffer, "(ACK:SEQ:", 9) == 0);
+    contact->established = evaluateResponse(readBuffer, &result);
+    if (!contact->established)
+        return false;
+    logMessage(INDI::Logger::DBG_DEBUG, "Controller sequence ids %s", link.isSequenced() ? "supported" : "not supported, one request at a time");
+
+    // Binary frames carry the sequence id in every frame so need it to be supported
+    if (link.isSequenced() && link.request("SET", "BINARY", "ON", readBuffer))
+        link.setBinaryFraming(evaluateResponse(readBuffer, &result) && result);
+    logMessage(INDI::Logger::DBG_DEBUG, "Controller binary framing %s", link.isBinaryFraming() ? "enabled" : "not supported, using text");
+
+    snapshotRequest = link.send("GET", ROOF_ALL_SWITCHES, "0");
+    edgesRequest = link.send("GET", ROOF_SWITCH_EDGES, "0");
+    eventsRequest = link.send("SET", "EVENTS", "ON");
+    contact->snapshot = (snapshotRequest >= 0) && link.await(snapshotRequest, readBuffer) &&
+                        evaluateSnapshot(readBuffer, &contact->opened, &contact->closed);
+    logMessage(INDI::Logger::DBG_DEBUG, "Controller switch snapshot request %s", contact->snapshot ? "supported" : "not supported, using single requests");
+    contact->edges = (edgesRequest >= 0) && link.await(edgesRequest, readBuffer) && evaluateEdges(readBuffer, contact->edge);
+    logMessage(INDI::Logger::DBG_DEBUG, "Controller switch edge times %s", contact->edges ? "supported" : "not supported");
+    contact->switchesRead = contact->snapshot || readRoofSwitches(link, &contact->opened, &contact->closed);
+    contact->events = (eventsRequest >= 0) && link.await(eventsRequest, readBuffer) &&
+                      evaluateResponse(readBuffer, &result) && result;
+    logMessage(INDI::Logger::DBG_DEBUG, "Controller switch events %s", contact->events ? "enabled" : "not supported, polling for status");
+    return true;
+}
+
+/*
+ * Take on what the handshake found, on the event loop
+ */
+void RollOffNano::applyContact(const InoContact &contact)
+{
+    contactEstablished = contact.established;
+    switchSnapshot = contact.snapshot;
+    switchEdges = contact.edges;
+    switchEvents = contact.events;
+    switchesValid = false;
+    if (contact.switchesRead)
+    {
+        fullyOpenedLimitSwitch = contact.opened ? ISS_ON : ISS_OFF;
+        fullyClosedLimitSwitch = contact.closed ? ISS_ON : ISS_OFF;
+        cacheSwitches();
+    }
+    if (contact.edges)
+        std::copy(contact.edge, contact.edge + 2, switchEdge);
+    if (contact.established)
+    {
+        LinkN[LINK_BAUD].value = contact.baud;
+        LinkNP.s = IPS_OK;
+    }
+}
+
+/*
+ * The simulated controller has the switch snapshot and nothing newer, its switches are polled
+ * through it as they would be through the worker.
+ */
+bool RollOffNano::simulatedContact()
+{
     contactEstablished = false;
-    if (writeIno("(CON:0:0)"))
+    switchesValid = false;
+    switchSnapshot = true;
+    switchEvents = false;
+    switchEdges = false;
+    inoSim.clear();
+    if (simTimerID >= 0)
     {
-        memset(readBuffer, 0, sizeof(readBuffer));
-        if (readIno(readBuffer))
+        IERmTimer(simTimerID);
+        simTimerID = -1;
+    }
+    inoSim.setTimeScale(SimClockN[0].value);
+    inoSim.setTravel(simulatedTravel());
+    contactEstablished = inoSim.contact();
+    return contactEstablished;
+}
+
+/*
+ * The simulated roof arrives well inside the timeout so that a move completes, leaving the timeout
+ * to the stuck switch fault.
+ */
+double RollOffNano::simulatedTravel()
+{
+    return std::max(RoofTimeoutN[0].value - SIM_TRAVEL_MARGIN, (double)SIM_TRAVEL_MIN);
+}
+
+/*
+ * Reach the controller, which may still be starting. Opening the port resets most Arduinos, which
+ * then spend a second or two in the bootloader before sending (EVT:READY:version). Rather than
+ * wait a fixed time, ask straight away in case it was not reset, then wait for it to report ready.
+ * Controllers that do not send it are asked again once the deadline has passed.
+ */
+bool RollOffNano::contactController(InoLink &link, char *response)
+{
+    char banner[MAXINOBUF];
+    InoFrame ready;
+    int sequence = link.send("CON", "0", "SEQ");
+
+    if (sequence >= 0 && link.await(sequence, response, CONTACT_WAIT))
+        return true;
+    if (link.awaitEvent(INO_TARGET_READY, banner, READY_DEADLINE) &&
+        inoParseFrame(banner, strlen(banner), &ready))
+        logMessage(INDI::Logger::DBG_SESSION, "Roof controller %.*s is ready", (int)ready.value.len, ready.value.data);
+    return link.request("CON", "0", "SEQ", response);
+}
+
+/*
+ * A controller that was not reset when the port last closed is still at the rate that session moved
+ * it to, until BAUD_IDLE_MILLI without a request sends it back to its starting rate. It cannot hear
+ * the port's rate, so ask at each faster rate and leave the port at the one that answers.
+ */
+bool RollOffNano::contactFasterRate(InoLink &link, char *response)
+{
+    int fd = link.getPort();
+    int startRate = inoGetBaudRate(fd);
+
+    for (int rate : baudRates)
+    {
+        if (rate == startRate || !inoSetBaudRate(fd, rate))
+            continue;
+        link.clear();
+        int sequence = link.send("CON", "0", "SEQ");
+        if (sequence >= 0 && link.await(sequence, response, CONTACT_WAIT))
         {
-            contactEstablished = evaluateResponse(readBuffer, &result);
-            return contactEstablished;
+            logMessage(INDI::Logger::DBG_SESSION, "Roof controller was still at %d baud from the last connection", rate);
+            return true;
         }
     }
+    inoSetBaudRate(fd, startRate);
+    link.clear();
     return false;
 }
 
+/*
+ * Move the link from the rate it was opened at to the fastest rate both ends support, returning the
+ * rate it runs at. The controller returns to its starting rate if it hears nothing valid at the new
+ * rate, so when the check at the new rate fails the driver does the same. Older controllers NAK the
+ * request.
+ */
+int RollOffNano::negotiateBaudRate(InoLink &link)
+{
+    char readBuffer[MAXINOBUF];
+    char rateText[16];
+    bool result = false;
+    int fd = link.getPort();
+    int startRate = inoGetBaudRate(fd);
+
+    for (int rate : baudRates)
+    {
+        if (rate <= startRate)
+            break;
+        snprintf(rateText, sizeof(rateText), "%d", rate);
+        if (!link.request("SET", "BAUD", rateText, readBuffer))
+            break;
+        if (!evaluateResponse(readBuffer, &result))
+            continue; // Rate not supported by the controller
+
+        // The controller is already listening at the new rate
+        if (!inoSetBaudRate(fd, rate))
+        {
+            logMessage(INDI::Logger::DBG_WARNING, "Unable to set the serial port to %d baud", rate);
+            msSleep(BAUD_TRIAL + 100);
+            break;
+        }
+        link.clear();
+        if (link.request("GET", "BAUD", "0", readBuffer) && evaluateResponse(readBuffer, &result))
+        {
+            logMessage(INDI::Logger::DBG_SESSION, "Roof controller link running at %d baud", rate);
+            return rate;
+        }
+
+        // The failed check waited MAXINOWAIT, by then the controller is back at the starting rate
+        logMessage(INDI::Logger::DBG_WARNING, "Roof controller did not respond at %d baud, returning to %d", rate, startRate);
+        inoSetBaudRate(fd, startRate);
+        link.clear();
+    }
+    return startRate;
+}
+
 /*
  * Whether roof is moving or stopped in any position along with the nature of the button requested will
  * determine the effect on the roof. This could mean stopping, or starting in a reversed direction.
+ * The button is pushed ahead of any switch polls waiting, returns false if it could not be queued.
  */
 bool RollOffNano::pushRoofButton(const char *button, bool switchOn, bool ignoreLock)
 {
-    char readBuffer[MAXINOBUF];
-    char writeBuffer[MAXINOBUF];
-    bool status;
-    bool switchState = false;
-    bool responseState = false; // true if the value in response to command was "ON"
+    InoJob job {};
 
     if (!contactEstablished)
     {
         LOG_WARN("No contact with the roof controller has been established");
         return false;
     }
-    
+    INDI_UNUSED(ignoreLock); // No lock switch on this controller
+
+    LOGF_DEBUG("Button pushed: %s", button);
+    job.tag = JOB_BUTTON;
+    InoWorker::addRequest(&job, "SET", button, switchOn ? "ON" : "OFF");
+    switchesValid = false; // The roof may be on its way, read the switches afresh
+    return postJob(job, true);
+}
 
 /*
- * if ACK return true and set result true|false indicating if switch is on
- *
+ * The roof was reported as set moving when the button was queued, undo that if the controller did not act on it.
  */
-bool RollOffNano::evaluateResponse(char *buff, bool *result)
+void RollOffNano::buttonPushed(const InoResult &result)
 {
-    char inoCmd[MAXINOCMD + 1];
-    char inoTarget[MAXINOTARGET + 1];
-    char inoVal[MAXINOVAL + 1];
+    bool responseState = false; // true if the value in response to command was "ON"
 
-    *result = false;
-    strcpy(inoCmd, strtok(buff, "(:"));
-    strcpy(inoTarget, strtok(nullptr, ":"));
-    strcpy(inoVal, strtok(nullptr, ")"));
-    LOGF_DEBUG("Returned from roof controller: Cmd: %s, Target: %s, Value: %s", inoCmd, inoTarget, inoVal);
-    if ((strcmp(inoCmd, "NAK")) == 0)
-    {
-        LOGF_WARN("Negative response from roof controller error: %s", inoVal);
-        return false;
-    }
-    *result = (strcmp(inoVal, "ON") == 0);
-    return true;
+    switchesValid = false; // Switches polled while the button was waiting are from before it
+    if (result.ok[0] && evaluateResponse(result.responses[0], &responseState))
+        return;
+    LOGF_WARN("Failed to operate controller to %s roof", roofOpening ? "open" : "close");
+    roofOpening = false;
+    roofClosing = false;
+    setDomeState(DOME_ERROR);
 }
 
-bool RollOffNano::readIno(char *retBuf)
+/*
+ * The controller acknowledges a stop once it has closed the relay, or if the pulse that set the roof
+ * moving is still in progress once the stop is due to follow it. The time from the abort is kept.
+ * An abort that is rejected or unanswered leaves the abort switch in alert.
+ */
+void RollOffNano::roofAborted(const InoResult &result)
 {
-    bool stop = false;
-    bool start_found = false;
-    int status;
-    int retCount = 0;
-    int totalCount = 0;
-    char *bufPtr = retBuf;
-    char errMsg[MAXINOERR];
+    bool responseState = false;
+    struct timespec now
+    {
+        0, 0
+    };
 
-    while (!stop)
+    if (!result.ok[0])
     {
-        bufPtr = bufPtr + retCount;
-        status = tty_read(PortFD, bufPtr, 1, MAXINOWAIT, &retCount);
-        if (status != TTY_OK)
-        {
-            tty_error_msg(status, errMsg, MAXINOERR);
-            LOGF_DEBUG("Roof control connection error: %s", errMsg);
-            communicationErrors++;
-            return false;
-        }
-        if (retCount > 0)
-        {
-            communicationErrors = 0;
-            if (*bufPtr == 0X28) // '('   Start found
-                start_found = true;
-            if (!start_found)
-                retCount = 0;
-            totalCount += retCount;
-            if ((*bufPtr == 0X29) || (totalCount >= MAXINOBUF - 2)) // ')'   End found
-            {
-                *(++bufPtr) = 0;
-                stop = true;
-            }
-        }
+        LOG_ERROR("Roof controller did not respond to the abort, the roof may still be moving");
+        AbortSP.s = IPS_ALERT;
+        IDSetSwitch(&AbortSP, nullptr);
+        return;
     }
-    return true;
+    // Rejected, as the roof was not moving or there is no relay to stop it. The relay did not fire.
+    if (!evaluateResponse(result.responses[0], &responseState))
+    {
+        LOG_ERROR("Roof controller rejected the abort, the roof has not been stopped by it");
+        AbortSP.s = IPS_ALERT;
+        IDSetSwitch(&AbortSP, nullptr);
+        return;
+    }
+    clockNow(&now);
+    LinkN[LINK_ABORT].value = (now.tv_sec - abortStart.tv_sec) * 1000.0 + (now.tv_nsec - abortStart.tv_nsec) / 1e6;
+    IDSetNumber(&LinkNP, nullptr);
+    LOGF_INFO("Roof controller stopped the roof %.0f ms after the abort", LinkN[LINK_ABORT].value);
 }
 
-bool RollOffNano::writeIno(const char *msg)
+/*
+ * if ACK return true and set result true|false indicating if switch is on
+ * If response is provided the parts of the frame are returned in it, they point into buff
+ */
+bool RollOffNano::evaluateResponse(const char *buff, bool *result, InoFrame *response)
 {
-    int retMsgLen = 0;
-    int status;
-    char errMsg[MAXINOERR];
+    InoFrame frame;
+    const char *error = nullptr;
 
-    if (strlen(msg) >= MAXINOLINE)
+    *result = false;
+    if (!inoParseFrame(buff, strlen(buff), &frame, &error))
     {
-        LOG_ERROR("Roof controller command message too long");
+        logMessage(INDI::Logger::DBG_WARNING, "Malformed response from roof controller, %s: %s", error, buff);
         return false;
     }
-    LOGF_DEBUG("Sent to roof controller: %s", msg);
-    tcflush(PortFD, TCIOFLUSH);
-    status = tty_write_string(PortFD, msg, &retMsgLen);
-    if (status != TTY_OK)
+    // Sequence id already matched
+    logMessage(INDI::Logger::DBG_DEBUG, "Returned from roof controller: Cmd: %s, Target: %.*s, Value: %.*s", inoCommandNames[frame.command],
+               (int)frame.targetText.len, frame.targetText.data, (int)frame.value.len, frame.value.data);
+    if (frame.command == INO_CMD_NAK)
     {
-        tty_error_msg(status, errMsg, MAXINOERR);
-        LOGF_DEBUG("roof control connection error: %s", errMsg);
+        logMessage(INDI::Logger::DBG_WARNING, "Negative response from roof controller error: %.*s", (int)frame.value.len, frame.value.data);
         return false;
     }
+    *result = frame.value.is("ON");
+    if (response != nullptr)
+        *response = frame;
     return true;
 }
 
 void RollOffNano::msSleep(int mSec)
 {
     struct timespec req = {0, 0};
-    req.tv_sec = 0;
-    req.tv_nsec = mSec * 1000000L;
-    nanosleep(&req, (struct timespec *)nullptr);
+    req.tv_sec = mSec / 1000;
+    req.tv_nsec = (mSec % 1000) * 1000000L;
+    // Carry on with the time remaining when a signal cuts the sleep short
+    while (nanosleep(&req, &req) < 0)
+    {
+        if (errno != EINTR)
+        {
+            LOGF_WARN("Unable to wait %d ms: %s", mSec, strerror(errno));
+            break;
+        }
+    }
 }
@@ -19,12 +19,21 @@
 #pragma once
 
 #include "indidome.h"
+#include "inolink.h"
+#include "inosim.h"
+#include "inoserial.h"
+#include "inoworker.h"
+#include "rooftravel.h"
+
+#include <string>
+#include <thread>
+#include <vector>
 
 class RollOffNano : public INDI::Dome
 {
   public:
-    RollOffNano();
-    virtual ~RollOffNano() override = default;
+    explicit RollOffNano(int roof = 1);
+    virtual ~RollOffNano() override;
 
     virtual bool initProperties();
     virtual void ISGetProperties(const char *dev) override;
@@ -32,10 +41,15 @@ class RollOffNano : public INDI::Dome
     const char *getDefaultName();
     bool updateProperties();
     virtual bool ISNewSwitch(const char *dev, const char *name, ISState *states, char *names[], int n);
+    virtual bool ISNewText(const char *dev, const char *name, char *texts[], char *names[], int n);
     virtual bool saveConfigItems(FILE *fp);
     virtual bool ISSnoopDevice(XMLEle *root);
     virtual bool Handshake();
 
+    // The simulated scenarios run by ctest and the soak test look inside the roof to check where it got to
+    friend class RollOffNanoSimTest;
+    friend class RollOffNanoSoak;
+
   protected:
     bool Connect();
     bool Disconnect();
@@ -45,33 +59,141 @@ class RollOffNano : public INDI::Dome
     virtual IPState Move(DomeDirection dir, DomeMotionCommand operation);
     virtual IPState Park();
     virtual IPState UnPark();
+    virtual bool Abort();
 
     virtual bool getFullOpenedLimitSwitch(bool*);
     virtual bool getFullClosedLimitSwitch(bool*);
 
 private:
+    // What the handshake found out about the controller, applied to the driver by applyContact()
+    struct InoContact
+    {
+        bool established;
+        bool snapshot;              // As switchSnapshot, switchEdges and switchEvents
+        bool edges;
+        bool events;
+        bool switchesRead;          // opened and closed were read
+        bool opened;
+        bool closed;
+        struct timespec edge[2];    // As switchEdge, when edges
+        int baud;
+        std::vector<std::pair<INDI::Logger::VerbosityLevel, std::string>> log; // Held while off the event loop
+    };
+
     void updateRoofStatus();
-    bool readRoofSwitch(const char* roofSwitchId, bool* result);
+    void applyRoofStatus(bool openedState, bool closedState);
+    bool checkRoofMotion(double timeleft);
+    void confirmRoofMotion();
+    void closeAllRoofs();
+    void startLink();
+    void stopLink();
+    void startReconnect();
+    void stopReconnect();
+    void reconnect();
+    void reconnected(bool status);
+    bool reconnecting() const;
+    static void reconnectHelper(void *context);
+    bool startContact();
+    void stopContact();
+    void runContact(std::string port, int rate, bool hangup);
+    void contactFinished();
+    static void contactHelper(int fd, void *context);
+    void closePort();
+    void scheduleTimer(uint32_t delay);
+    uint32_t timerDelay(uint32_t delay);
+    void clockNow(struct timespec *now);
+    bool postJob(const InoJob &job, bool urgent);
+    void simulatedResults();
+    static void simulatedHelper(void *context);
+    bool simulatedContact();
+    double simulatedTravel();
+    void handleLinkResult(const InoResult &result);
+    void handleSwitchEvent(const char*);
+    void processSwitchEvents();
+    static void linkResultHelper(int fd, void *context);
+    static void linkEventHelper(const char *frame, void *context);
+    static void processEventsHelper(void *context);
+    void pollRoofSwitches();
+    void switchesPolled(const InoResult &result);
+    void buttonPushed(const InoResult &result);
+    void roofAborted(const InoResult &result);
+    bool readRoofSwitches(InoLink &link, bool* openedState, bool* closedState);
+    bool switchesCached();
+    void cacheSwitches();
+    bool evaluateSnapshot(const char*, bool* openedState, bool* closedState);
+    bool evaluateEdges(const char*, struct timespec edge[2]);
     bool roofOpen();
     bool roofClose();
     bool roofAbort();
     bool pushRoofButton(const char*, bool switchOn, bool ignoreLock);
-    bool initialContact();
-    bool evaluateResponse(char*, bool*);
-    bool writeIno(const char*);
-    bool readIno(char*);
+    bool contactRoof(InoLink &link, int fd, bool hangup, InoContact *contact);
+    bool initialContact(InoLink &link, InoContact *contact);
+    bool contactController(InoLink &link, char *response);
+    bool contactFasterRate(InoLink &link, char *response);
+    int negotiateBaudRate(InoLink &link);
+    void logMessage(INDI::Logger::VerbosityLevel level, const char *format, ...);
+    void applyContact(const InoContact &contact);
+    void recordConnectTime();
+    bool evaluateResponse(const char*, bool*, InoFrame* response = nullptr);
     void msSleep(int);
 
     bool setupConditions();
-    float CalcTimeLeft(timeval);
+    float CalcTimeLeft(timespec);
+    uint32_t motionPollDelay(double timeleft);
+    double travelTime(int dir, double observed);
+    void recordTravelTime(int dir, double seconds);
+    double motionTimeout(int dir);
+    void updateTravelStatus();
+    void updateLinkStats(const InoLink::Stats &stats);
+    void updateRoofPosition();
+    void positionTick();
+    static void positionHelper(void *context);
+    void markChanged(int property);
+    void publishChanges();
+    static void publishHelper(void *context);
     double MotionRequest { 0 };
-    struct timeval MotionStart { 0, 0 };
+    struct timespec MotionStart { 0, 0 };
+    RoofTravel roofTravel[2];           // Measured moves to open (DOME_CW) and close (DOME_CCW)
+    bool motionConfirmed = true;        // Switches have been read since the roof was set moving
+    bool switchesValid = false;         // fullyOpenedLimitSwitch and fullyClosedLimitSwitch as read at switchesRead
+    struct timespec switchesRead { 0, 0 };
     bool contactEstablished = false;
+    InoLink inoLink;                // Requests to and events from the controller
+    InoWorker inoWorker;            // Runs inoLink once connected, results come back through linkResultCallbackID
+    InoSim inoSim;                  // Answers the jobs in simulation mode, results come back through simTimerID
+    int simTimerID = -1;
+    enum { JOB_SWITCHES, JOB_BUTTON, JOB_ABORT };
+    bool pollPending = false;       // A JOB_SWITCHES has been posted and its result not yet handled
+    unsigned int linkErrors = 0;    // Link errors as of the last result
+    int missedReads = 0;            // Switch reads in a row that went unanswered
+    int reconnectTimerID = -1;      // Waiting to reconnect after losing the link
+    int reconnectDelay = 0;
+    int portRate = 0;               // Baud rate the port is opened at, reopened at it to reconnect
+    int reconnectFD = -1;           // Port opened by a reconnect, owned by the driver rather than serialConnection
+    std::thread contactThread;      // Handshake of a reconnect, kept off the event loop
+    int contactPipe[2] { -1, -1 };  // Written by contactThread when it is done
+    int contactCallbackID = -1;
+    InoLink contactLink;            // Link, port and findings of contactThread, only read once it is joined
+    int contactFD = -1;
+    InoContact contactFound {};
+    static thread_local InoContact *loggingTo; // On contactThread, holds the lines it logs
+    int statusTimerID = -1;
+    bool switchSnapshot = false;    // Controller answers (GET:ALL:0) with every switch in one frame
+    bool switchEvents = false;      // Controller sends (EVT:switch:ON|OFF) when a switch changes
+    bool switchEdges = false;       // Controller answers (GET:EDGES:0) with how long ago each switch changed
+    struct timespec switchEdge[2] {};   // When the opened (DOME_CW) and closed (DOME_CCW) switches last changed
+    int linkResultCallbackID = -1;
+    int switchEventTimerID = -1;
     bool roofOpening = false;
     bool roofClosing = false;
-    ILight RoofStatusL[5];
+    ILight RoofStatusL[3];
     ILightVectorProperty RoofStatusLP;
     enum { ROOF_STATUS_OPENED, ROOF_STATUS_CLOSED, ROOF_STATUS_MOVING };
+    INumber RoofPositionN[2] {};
+    INumberVectorProperty RoofPositionNP;
+    enum { POSITION_OPEN, POSITION_REMAINING };
+    double positionStart = 0;       // Percent open when the move in progress started
+    int positionTimerID = -1;
 
     ISwitch LockS[2];
     ISwitchVectorProperty LockSP;
@@ -87,11 +209,42 @@ private:
     ISState roofAuxiliarySwitch {ISS_OFF};
     INumber RoofTimeoutN[1] {};
     INumberVectorProperty RoofTimeoutNP;
+    INumber RoofTravelN[6] {};
+    INumberVectorProperty RoofTravelNP;
+    enum { TRAVEL_OPEN_P50, TRAVEL_OPEN_P99, TRAVEL_OPEN_TIMEOUT, TRAVEL_CLOSE_P50, TRAVEL_CLOSE_P99, TRAVEL_CLOSE_TIMEOUT };
+    IText RoofTravelT[2] {};
+    ITextVectorProperty RoofTravelTP;
+    ISwitch AutoTimeoutS[2];
+    ISwitchVectorProperty AutoTimeoutSP;
+    enum { AUTO_TIMEOUT_ENABLE, AUTO_TIMEOUT_DISABLE };
+    INumber SwitchCacheN[1] {};
+    INumberVectorProperty SwitchCacheNP;
+    INumber PublishN[1] {};
+    INumberVectorProperty PublishNP;
+    enum { PUBLISH_STATUS, PUBLISH_TRAVEL, PUBLISH_DIAGNOSTICS, PUBLISH_POSITION, PUBLISH_HISTORY, PUBLISH_PROPERTIES };   // Properties sent by markChanged()
+    bool publishDirty[PUBLISH_PROPERTIES] {};
+    struct timespec publishedAt[PUBLISH_PROPERTIES] {};
+    int publishTimerID = -1;
+    INumber LinkCountersN[7] {};
+    INumberVectorProperty LinkCountersNP;
+    enum { COUNT_TRANSACTIONS, COUNT_TIMEOUTS, COUNT_NAKS, COUNT_MALFORMED, COUNT_BYTES_IN, COUNT_BYTES_OUT, COUNT_RESYNCS };
+    INumber LinkLatencyN[6] {};
+    INumberVectorProperty LinkLatencyNP;
+    INumber LinkN[3] {};
+    INumberVectorProperty LinkNP;
+    enum { LINK_BAUD, LINK_CONNECT, LINK_ABORT };
+    ISwitch CloseAllS[1];
+    ISwitchVectorProperty CloseAllSP;
+    ISwitch ResetS[2];
+    ISwitchVectorProperty ResetSP;
+    enum { RESET_ON_CONNECT, RESET_NEVER };
+    struct timespec connectStart { 0, 0 };
+    struct timespec abortStart { 0, 0 };
     enum { EXPIRED_CLEAR, EXPIRED_OPEN, EXPIRED_CLOSE };
     unsigned int roofTimedOut;
-    bool simRoofOpen = false;
-    bool simRoofClosed = true;
-    unsigned int communicationErrors = 0;
-    
+    INumber SimClockN[1] {};
+    INumberVectorProperty SimClockNP;
+    ISwitch SimFaultS[InoSim::FAULTS];
+    ISwitchVectorProperty SimFaultSP;
 };
 
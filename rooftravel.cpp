@@ -0,0 +1,95 @@
+/*******************************************************************************
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Library General Public
+ License version 2 as published by the Free Software Foundation.
+ .
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Library General Public License for more details.
+ .
+ You should have received a copy of the GNU Library General Public License
+ along with this library; see the file COPYING.LIB.  If not, write to
+ the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ Boston, MA 02110-1301, USA.
+*******************************************************************************/
+
+
+#include "rooftravel.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+
+void RoofTravel::record(double seconds)
+{
+    if (seconds <= 0)
+        return;
+    history[next] = seconds;
+    next = (next + 1) % TRAVEL_SAMPLES;
+    if (samples < TRAVEL_SAMPLES)
+        samples++;
+}
+
+void RoofTravel::clear()
+{
+    next = 0;
+    samples = 0;
+}
+
+double RoofTravel::percentile(double p) const
+{
+    double sorted[TRAVEL_SAMPLES];
+
+    if (samples == 0)
+        return 0;
+    for (int i = 0; i < samples; i++)
+        sorted[i] = at(i);
+    std::sort(sorted, sorted + samples);
+    int rank = (int)(p * samples + 0.999999) - 1;
+    return sorted[std::min(std::max(rank, 0), samples - 1)];
+}
+
+double RoofTravel::recentMedian() const
+{
+    double recent[TRAVEL_RECENT];
+
+    if (samples < TRAVEL_RECENT)
+        return 0;
+    for (int i = 0; i < TRAVEL_RECENT; i++)
+        recent[i] = at(i);
+    std::sort(recent, recent + TRAVEL_RECENT);
+    return recent[TRAVEL_RECENT / 2];
+}
+
+void RoofTravel::toText(char *text, size_t size) const
+{
+    size_t used = 0;
+
+    text[0] = '\0';
+    for (int age = samples - 1; age >= 0 && used < size; age--)
+    {
+        int written = snprintf(text + used, size - used, (used > 0) ? " %.1f" : "%.1f", at(age));
+        if (written < 0 || (size_t)written >= size - used)
+        {
+            text[used] = '\0';
+            break;
+        }
+        used += written;
+    }
+}
+
+void RoofTravel::fromText(const char *text)
+{
+    char *end;
+
+    clear();
+    while (text != nullptr && *text != '\0')
+    {
+        double seconds = strtod(text, &end);
+        if (end == text)
+            break;
+        record(seconds);
+        text = end;
+    }
+}
@@ -0,0 +1,51 @@
+/*******************************************************************************
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Library General Public
+ License version 2 as published by the Free Software Foundation.
+ .
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Library General Public License for more details.
+ .
+ You should have received a copy of the GNU Library General Public License
+ along with this library; see the file COPYING.LIB.  If not, write to
+ the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ Boston, MA 02110-1301, USA.
+*******************************************************************************/
+
+
+#pragma once
+
+#include <cstddef>
+
+#define TRAVEL_SAMPLES 50 // Moves kept for each direction
+#define TRAVEL_RECENT 5   // Latest moves compared with the rest to spot a slowing drive
+
+/*
+ * Rolling record of how long the roof takes to travel in one direction.
+ * Kept as the latest TRAVEL_SAMPLES durations, saved and restored as text "15.2 15.1 ..."
+ * oldest first.
+ */
+class RoofTravel
+{
+  public:
+    void record(double seconds);
+    void clear();
+    int count() const { return samples; }
+
+    // Duration that fraction p of the recorded moves took no longer than, 0 with nothing recorded
+    double percentile(double p) const;
+    // Median of the latest TRAVEL_RECENT moves, 0 until there are that many
+    double recentMedian() const;
+
+    void toText(char *text, size_t size) const;
+    void fromText(const char *text);
+
+  private:
+    double at(int age) const { return history[(next + TRAVEL_SAMPLES - 1 - age) % TRAVEL_SAMPLES]; }
+
+    double history[TRAVEL_SAMPLES] {};
+    int next { 0 };
+    int samples { 0 };
+};
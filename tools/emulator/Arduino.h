@@ -0,0 +1,82 @@
+/*******************************************************************************
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Library General Public
+ License version 2 as published by the Free Software Foundation.
+ .
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Library General Public License for more details.
+ .
+ You should have received a copy of the GNU Library General Public License
+ along with this library; see the file COPYING.LIB.  If not, write to
+ the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ Boston, MA 02110-1301, USA.
+*******************************************************************************/
+
+/*
+ * Just enough of the Arduino core to build the controller sketch on the host.
+ * Time is virtual, see emulator.h, and Serial is a pseudo terminal or an in memory buffer.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define HIGH 0x1
+#define LOW 0x0
+#define INPUT 0x0
+#define OUTPUT 0x1
+#define INPUT_PULLUP 0x2
+
+// Flash is ordinary memory on the host
+class __FlashStringHelper;
+#define PROGMEM
+#define F(s) (reinterpret_cast<const __FlashStringHelper *>(s))
+#define pgm_read_byte(p) (*(const uint8_t *)(p))
+#define strlen_P strlen
+#define strcpy_P strcpy
+#define strcmp_P strcmp
+#define pgm_read_ptr(p) (*(const void * const *)(p))
+
+typedef uint8_t byte;
+
+class HardwareSerial
+{
+  public:
+    void begin(unsigned long baud);
+    void end();
+    int available();
+    int read();
+    int availableForWrite();
+    size_t write(uint8_t c);
+    size_t write(const uint8_t *buffer, size_t size);
+    size_t write(const char *buffer, size_t size) { return write((const uint8_t *)buffer, size); }
+    size_t print(const char *text);
+    size_t println(const char *text);
+    size_t print(const __FlashStringHelper *text) { return print(reinterpret_cast<const char *>(text)); }
+    size_t println(const __FlashStringHelper *text) { return println(reinterpret_cast<const char *>(text)); }
+    void flush() {}
+    operator bool() { return true; }
+    unsigned long baud() const { return rate; }
+
+  private:
+    unsigned long rate { 0 };
+};
+
+extern HardwareSerial Serial;
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t value);
+int digitalRead(uint8_t pin);
+unsigned long millis();
+void delay(unsigned long ms);
+
+// The sketch runs on one thread with no interrupts, it samples what would raise them
+inline void noInterrupts() {}
+inline void interrupts() {}
+
+char *itoa(int value, char *text, int radix);
+char *ltoa(long value, char *text, int radix);
+char *ultoa(unsigned long value, char *text, int radix);
@@ -0,0 +1,305 @@
+/*******************************************************************************
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Library General Public
+ License version 2 as published by the Free Software Foundation.
+ .
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Library General Public License for more details.
+ .
+ You should have received a copy of the GNU Library General Public License
+ along with this library; see the file COPYING.LIB.  If not, write to
+ the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ Boston, MA 02110-1301, USA.
+*******************************************************************************/
+
+#include "Arduino.h"
+#include "emulator.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <unistd.h>
+#include <vector>
+
+HardwareSerial Serial;
+
+static int serialFD = -1;
+static char rxBuffer[EMU_SERIAL_RX];
+static int rxHead = 0;
+static int rxCount = 0;
+static char txBuffer[4096];
+static size_t txCount = 0;
+static unsigned long hostBaud = 0;
+
+static unsigned long virtualMillis = 0;
+static uint8_t pinValue[EMU_PINS];
+
+static unsigned long roofTravel = EMU_ROOF_TRAVEL;
+static double roofPosition = 0;     // Starts closed
+static int roofDirection = 0;       // 1 opening, -1 closing, 0 stopped
+static int roofLastDirection = -1;
+static unsigned long relayChanged = 0;
+static unsigned long relayPushes = 0;
+
+/*
+ * Serial link
+ */
+void emuAttachSerial(int fd)
+{
+    serialFD = fd;
+}
+
+// Never a frame start, so a garbled byte cannot be taken for the start of a request or reply
+static char garble(char c)
+{
+    return (hostBaud != 0 && hostBaud != Serial.baud()) ? (char)(0xF0 | (c & 0x0F)) : c;
+}
+
+void emuInject(const char *text)
+{
+    for (; *text != '\0' && rxCount < EMU_SERIAL_RX; text++, rxCount++)
+        rxBuffer[(rxHead + rxCount) % EMU_SERIAL_RX] = garble(*text);
+}
+
+void emuSetHostBaud(unsigned long baud)
+{
+    hostBaud = baud;
+}
+
+size_t emuTakeOutput(char *buffer, size_t size)
+{
+    size_t n = (txCount < size - 1) ? txCount : size - 1;
+    memcpy(buffer, txBuffer, n);
+    buffer[n] = '\0';
+    txCount = 0;
+    return n;
+}
+
+void HardwareSerial::begin(unsigned long baud)
+{
+    rate = baud;
+}
+
+void HardwareSerial::end()
+{
+    rxHead = 0;
+    rxCount = 0;
+}
+
+int HardwareSerial::available()
+{
+    // Top up the receive buffer from the port, whatever does not fit stays in the port
+    if (serialFD >= 0 && rxCount < EMU_SERIAL_RX)
+    {
+        char input[EMU_SERIAL_RX];
+        ssize_t n = ::read(serialFD, input, EMU_SERIAL_RX - rxCount);
+        for (ssize_t i = 0; i < n; i++, rxCount++)
+            rxBuffer[(rxHead + rxCount) % EMU_SERIAL_RX] = garble(input[i]);
+    }
+    return rxCount;
+}
+
+int HardwareSerial::read()
+{
+    if (available() == 0)
+        return -1;
+    int c = (unsigned char)rxBuffer[rxHead];
+    rxHead = (rxHead + 1) % EMU_SERIAL_RX;
+    rxCount--;
+    return c;
+}
+
+int HardwareSerial::availableForWrite()
+{
+    return 63;
+}
+
+// Output as the host hears it
+static size_t send(const uint8_t *buffer, size_t size)
+{
+    if (serialFD >= 0)
+    {
+        size_t written = 0;
+        while (written < size)
+        {
+            ssize_t n = ::write(serialFD, buffer + written, size - written);
+            if (n < 0 && errno != EAGAIN && errno != EINTR)
+                break;
+            if (n > 0)
+                written += n;
+        }
+        return written;
+    }
+    size_t n = (size < sizeof(txBuffer) - txCount) ? size : sizeof(txBuffer) - txCount;
+    memcpy(txBuffer + txCount, buffer, n);
+    txCount += n;
+    return n;
+}
+
+size_t HardwareSerial::write(const uint8_t *buffer, size_t size)
+{
+    std::vector<uint8_t> heard(buffer, buffer + size);
+
+    for (auto &c : heard)
+        c = garble(c);
+    return send(heard.data(), heard.size());
+}
+
+size_t HardwareSerial::write(uint8_t c)
+{
+    return write(&c, 1);
+}
+
+size_t HardwareSerial::print(const char *text)
+{
+    return write((const uint8_t *)text, strlen(text));
+}
+
+size_t HardwareSerial::println(const char *text)
+{
+    return print(text) + print("\r\n");
+}
+
+/*
+ * Roof motion, advanced with the clock
+ */
+static void moveRoof(unsigned long ms)
+{
+    if (roofDirection == 0)
+        return;
+    roofPosition += roofDirection * (double)ms / roofTravel;
+    if (roofPosition >= 1 || roofPosition <= 0)
+    {
+        roofPosition = (roofPosition >= 1) ? 1 : 0;
+        roofDirection = 0;
+    }
+}
+
+// The motor controller acts on the button being pressed, the relay closing
+static void pushButton()
+{
+    if (roofDirection != 0)
+    {
+        roofDirection = 0;
+        return;
+    }
+    if (roofPosition <= 0)
+        roofDirection = 1;
+    else if (roofPosition >= 1)
+        roofDirection = -1;
+    else
+        roofDirection = -roofLastDirection;
+    roofLastDirection = roofDirection;
+}
+
+void emuSetTravel(unsigned long ms)
+{
+    roofTravel = (ms > 0) ? ms : 1;
+}
+
+double emuRoofPosition()
+{
+    return roofPosition;
+}
+
+bool emuRoofMoving()
+{
+    return roofDirection != 0;
+}
+
+unsigned long emuRelayPushes()
+{
+    return relayPushes;
+}
+
+bool emuBusy()
+{
+    return roofDirection != 0 || pinValue[EMU_RELAY_PIN] == LOW || virtualMillis - relayChanged < 100;
+}
+
+/*
+ * Clock and pins
+ */
+unsigned long emuMillis()
+{
+    return virtualMillis;
+}
+
+void emuAdvance(unsigned long ms)
+{
+    virtualMillis += ms;
+    moveRoof(ms);
+}
+
+unsigned long millis()
+{
+    return virtualMillis;
+}
+
+void delay(unsigned long ms)
+{
+    emuAdvance(ms);
+}
+
+void pinMode(uint8_t pin, uint8_t mode)
+{
+    if (pin < EMU_PINS && mode == INPUT_PULLUP)
+        pinValue[pin] = HIGH;
+}
+
+void digitalWrite(uint8_t pin, uint8_t value)
+{
+    if (pin >= EMU_PINS)
+        return;
+    if (pin == EMU_RELAY_PIN && value != pinValue[pin])
+    {
+        relayChanged = virtualMillis;
+        if (value == LOW)
+        {
+            relayPushes++;
+            pushButton();
+        }
+    }
+    pinValue[pin] = value;
+}
+
+// Switches close to ground against their pull up
+int digitalRead(uint8_t pin)
+{
+    switch (pin)
+    {
+        case EMU_OPENED_PIN:
+            return (roofPosition >= 1) ? LOW : HIGH;
+        case EMU_CLOSED_PIN:
+            return (roofPosition <= 0) ? LOW : HIGH;
+        case EMU_RAPARK_PIN:
+        case EMU_DECPARK_PIN:
+            return LOW;
+        default:
+            return (pin < EMU_PINS) ? pinValue[pin] : LOW;
+    }
+}
+
+char *ltoa(long value, char *text, int radix)
+{
+    if (radix == 16)
+        sprintf(text, "%lx", value);
+    else
+        sprintf(text, "%ld", value);
+    return text;
+}
+
+char *itoa(int value, char *text, int radix)
+{
+    return ltoa(value, text, radix);
+}
+
+char *ultoa(unsigned long value, char *text, int radix)
+{
+    if (radix == 16)
+        sprintf(text, "%lx", value);
+    else
+        sprintf(text, "%lu", value);
+    return text;
+}
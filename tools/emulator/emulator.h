@@ -0,0 +1,58 @@
+/*******************************************************************************
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Library General Public
+ License version 2 as published by the Free Software Foundation.
+ .
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Library General Public License for more details.
+ .
+ You should have received a copy of the GNU Library General Public License
+ along with this library; see the file COPYING.LIB.  If not, write to
+ the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ Boston, MA 02110-1301, USA.
+*******************************************************************************/
+
+/*
+ * Host side of the controller emulator: the virtual clock, the serial link and a roof driven
+ * by the relay through its limit switches.
+ *
+ * The roof follows a single button motor controller. A relay pulse starts a stopped roof,
+ * towards open unless it is already fully opened or last ran that way, and stops a moving one.
+ * The opened and closed switches close at the ends of its travel.
+ */
+#pragma once
+
+#include <cstddef>
+
+#define EMU_ROOF_TRAVEL 15000   // Virtual milliseconds for the roof to travel fully open or closed
+#define EMU_PINS 20
+#define EMU_SERIAL_RX 64        // Receive buffer of the Nano, input beyond it waits in the port
+
+// Pins as assigned in the sketch, the relay is given a pin as the sketch leaves it unassigned
+#define EMU_OPENED_PIN 2
+#define EMU_CLOSED_PIN 3
+#define EMU_RAPARK_PIN 4
+#define EMU_DECPARK_PIN 5
+#define EMU_RELAY_PIN 6
+
+// Serial traffic goes to fd, or with -1 to an in memory buffer read with emuTakeOutput()
+void emuAttachSerial(int fd);
+// Queue bytes as if they had arrived from the host
+void emuInject(const char *text);
+// Fetch serial output written since the last call when not attached to a port
+size_t emuTakeOutput(char *buffer, size_t size);
+// Rate the host end of the link is at, 0 to always match the sketch. While the two differ every
+// byte is garbled both ways, as a UART at the wrong rate reads framing errors.
+void emuSetHostBaud(unsigned long baud);
+
+unsigned long emuMillis();
+void emuAdvance(unsigned long ms);
+
+void emuSetTravel(unsigned long ms);
+double emuRoofPosition();           // 0 closed to 1 opened
+bool emuRoofMoving();
+unsigned long emuRelayPushes();     // Times the relay has closed
+// Relay pulse or roof motion in progress, time may be skipped forward while waiting on them
+bool emuBusy();
@@ -0,0 +1,484 @@
+/*******************************************************************************
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Library General Public
+ License version 2 as published by the Free Software Foundation.
+ .
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Library General Public License for more details.
+ .
+ You should have received a copy of the GNU Library General Public License
+ along with this library; see the file COPYING.LIB.  If not, write to
+ the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ Boston, MA 02110-1301, USA.
+*******************************************************************************/
+
+/*
+ * Run the controller sketch on the host against a pseudo terminal the driver can connect to.
+ *
+ *   inoemu [-l link] [-t travel ms] [-r] [-c cycles] [-a aborts] [-n] [-m]
+ *     -l  also make the port reachable through the symbolic link given
+ *     -t  virtual milliseconds for the roof to travel, default EMU_ROOF_TRAVEL
+ *     -r  keep virtual time to real time throughout
+ *     -c  no port, open and close the roof the number of times given and report
+ *     -a  no port, stop the roof at points through its travel the number of times given and
+ *         report the time from each abort request to the relay closing. The sketch refuses to
+ *         stop a roof moving for longer than ROOF_OPEN_MILLI, keep the travel within it. Then
+ *         check an abort is refused for a stationary roof, and after an OPEN refused as busy.
+ *     -n  no port, move the link to a faster rate then reconnect without resetting the sketch, as
+ *         with Controller Reset set to Never, and report whether the host gets it back
+ *     -m  no port, move the link to a faster rate and open a roof that takes longer than the
+ *         sketch waits on a quiet host, reading the switches through the move as the driver does,
+ *         and report whether the arrival event comes through at the faster rate
+ *
+ * The port follows the rate the driver sets on it, while that differs from the sketch's rate
+ * both ends see only garbled bytes.
+ *
+ * Virtual time follows real time while the sketch is waiting on the host, so its timeouts
+ * behave as on the Nano. While a relay pulse or the roof is moving nothing real is being waited
+ * on and each pass of loop() moves the clock on a millisecond without waiting, a roof travel of
+ * 15 s takes a few milliseconds.
+ */
+#include "Arduino.h"
+#include "emulator.h"
+#include "inoserial.h"
+
+#include <algorithm>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+
+#define EMU_LONG_TRAVEL 45000   // Virtual milliseconds for the -m roof, longer than the sketch's BAUD_IDLE_MILLI
+#define EMU_HEARTBEAT 10000     // Virtual milliseconds between the driver's switch reads with switch events
+
+void setup();
+void loop();
+
+static volatile sig_atomic_t running = 1;
+
+static void stop(int)
+{
+    running = 0;
+}
+
+static double realMillis()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000.0 + now.tv_nsec / 1e6;
+}
+
+// Run the sketch until the condition holds or limit virtual milliseconds pass
+static bool runUntil(bool (*condition)(), unsigned long limit)
+{
+    unsigned long start = emuMillis();
+    while (!condition())
+    {
+        if (emuMillis() - start >= limit)
+            return false;
+        loop();
+        emuAdvance(1);
+    }
+    return true;
+}
+
+static bool roofOpened()
+{
+    return emuRoofPosition() >= 1 && !emuBusy();
+}
+
+static bool roofClosed()
+{
+    return emuRoofPosition() <= 0 && !emuBusy();
+}
+
+// Send a request, expect its acknowledgement and the roof to start then let it run to the end
+static bool roofCommand(const char *request, const char *ack, bool (*done)(), unsigned long travel)
+{
+    char output[256];
+
+    emuInject(request);
+    if (!runUntil(emuRoofMoving, 1000))
+        return false;
+    emuTakeOutput(output, sizeof(output));
+    if (strstr(output, ack) == nullptr)
+    {
+        fprintf(stderr, "%s answered with %s\n", request, output);
+        return false;
+    }
+    return runUntil(done, travel * 2);
+}
+
+static int cycle(int cycles, unsigned long travel)
+{
+    int failures = 0;
+    double start = realMillis();
+
+    for (int i = 0; i < cycles; i++)
+    {
+        if (!roofCommand("(SET:OPEN:ON)", "(ACK:OPEN:ON)", roofOpened, travel) ||
+                !roofCommand("(SET:CLOSE:ON)", "(ACK:CLOSE:ON)", roofClosed, travel))
+        {
+            fprintf(stderr, "Cycle %d failed with the roof at %.2f\n", i + 1, emuRoofPosition());
+            failures++;
+        }
+    }
+    printf("%d open/close cycles, %d failed, %.1f s virtual in %.3f s real\n", cycles, failures,
+           emuMillis() / 1000.0, (realMillis() - start) / 1000.0);
+    return failures == 0 ? 0 : 1;
+}
+
+static bool roofStopped()
+{
+    return !emuBusy();
+}
+
+/*
+ * Abort opening moves at points spread over the travel, starting with the relay pulse that set the
+ * roof moving, then close the roof again. The time taken is from the request being available to
+ * the sketch to its relay closing.
+ */
+static int abortMoves(int aborts, unsigned long travel)
+{
+    char output[256];
+    unsigned long worst = 0;
+    int immediate = 0;
+    int failures = 0;
+
+    for (int i = 0; i < aborts; i++)
+    {
+        unsigned long at = (travel * 9 / 10) * i / aborts;
+        unsigned long pushes = emuRelayPushes() + 2; // Open then stop
+        emuInject("(SET:OPEN:ON)");
+        for (unsigned long ms = 0; ms < at; ms++)
+        {
+            loop();
+            emuAdvance(1);
+        }
+        emuTakeOutput(output, sizeof(output));
+
+        unsigned long start = emuMillis();
+        emuInject("(SET:ABORT:ON)");
+        while (emuMillis() - start < 2000)
+        {
+            loop();
+            if (emuRelayPushes() == pushes)
+                break;
+            emuAdvance(1);
+        }
+        unsigned long taken = emuMillis() - start;
+        runUntil(roofStopped, 2000);
+        emuTakeOutput(output, sizeof(output));
+        if (strstr(output, "(ACK:ABORT:ON)") == nullptr || emuRoofMoving() || emuRoofPosition() >= 1)
+        {
+            fprintf(stderr, "Abort %d at %lu ms failed with the roof at %.2f: %s\n", i + 1, at, emuRoofPosition(), output);
+            failures++;
+        }
+        worst = std::max(worst, taken);
+        immediate += (taken <= 1) ? 1 : 0;
+        if (!roofCommand("(SET:CLOSE:ON)", "(ACK:CLOSE:ON)", roofClosed, travel))
+        {
+            fprintf(stderr, "Unable to close the roof after abort %d\n", i + 1);
+            return 1;
+        }
+    }
+
+    // A roof at the end of its travel is left alone
+    emuInject("(SET:ABORT:ON)");
+    for (int ms = 0; ms < 10; ms++)
+    {
+        loop();
+        emuAdvance(1);
+    }
+    emuTakeOutput(output, sizeof(output));
+    if (strstr(output, "(NAK:ERROR:") == nullptr || emuRoofMoving())
+    {
+        fprintf(stderr, "Abort of a stationary roof answered with %s\n", output);
+        failures++;
+    }
+
+    // An OPEN refused while the relay is busy leaves the roof stationary, so is not stopped
+    unsigned long pushes = emuRelayPushes();
+    emuInject("(SET:CLOSE:OFF)");
+    for (int ms = 0; ms < 5; ms++)
+    {
+        loop();
+        emuAdvance(1);
+    }
+    emuInject("(SET:OPEN:ON)");
+    for (int ms = 0; ms < 5; ms++)
+    {
+        loop();
+        emuAdvance(1);
+    }
+    emuTakeOutput(output, sizeof(output));
+    bool refused = strstr(output, "(ACK:CLOSE:OFF)") != nullptr && strstr(output, "(NAK:ERROR:") != nullptr;
+    runUntil(roofStopped, 2000);
+    emuInject("(SET:ABORT:ON)");
+    for (int ms = 0; ms < 10; ms++)
+    {
+        loop();
+        emuAdvance(1);
+    }
+    emuTakeOutput(output, sizeof(output));
+    if (!refused || strstr(output, "(NAK:ERROR:") == nullptr || emuRelayPushes() != pushes || emuRoofMoving())
+    {
+        fprintf(stderr, "Abort after an OPEN refused as busy answered with %s\n", output);
+        failures++;
+    }
+    printf("%d aborts, %d failed, relay closed within 1 ms of the request for %d, the rest waited on the start pulse, "
+           "%lu ms at worst\n", aborts, failures, immediate, worst);
+    return failures == 0 ? 0 : 1;
+}
+
+// Send a request at the host's present rate, true if expect is in what comes back within ms
+static bool answered(const char *request, const char *expect, unsigned long ms)
+{
+    char output[256];
+
+    emuTakeOutput(output, sizeof(output));
+    emuInject(request);
+    for (unsigned long i = 0; i < ms; i++)
+    {
+        loop();
+        emuAdvance(1);
+    }
+    emuTakeOutput(output, sizeof(output));
+    return strstr(output, expect) != nullptr;
+}
+
+static unsigned long startRate;
+
+static bool atStartRate()
+{
+    return Serial.baud() == startRate;
+}
+
+/*
+ * The host moves the link to 250000 baud then closes the port without the board resetting, and
+ * opens it again at the starting rate. The sketch is still at 250000 so the driver asks again at
+ * that rate. Left alone, the sketch returns to the starting rate by itself.
+ */
+static int reconnect()
+{
+    int failures = 0;
+    struct
+    {
+        const char *step;
+        unsigned long hostRate;
+        const char *request;
+        const char *expect;
+        bool heard;
+    } steps[] = {
+        { "first contact", startRate, "(CON:0:SEQ)", "(ACK:SEQ:", true },
+        { "move to 250000", startRate, "(SET:BAUD:250000)", "(ACK:BAUD:250000)", true },
+        { "check at 250000", 250000, "(GET:BAUD:0)", "(ACK:BAUD:250000)", true },
+        { "reopen at the starting rate", startRate, "(CON:0:SEQ)", "(ACK:", false },
+        { "ask again at 250000", 250000, "(CON:0:SEQ)", "(ACK:SEQ:", true },
+    };
+
+    for (const auto &step : steps)
+    {
+        emuSetHostBaud(step.hostRate);
+        if (answered(step.request, step.expect, 250) != step.heard)
+        {
+            fprintf(stderr, "%s: %s at %lu baud was %s\n", step.step, step.request, step.hostRate,
+                    step.heard ? "not answered" : "answered");
+            failures++;
+        }
+    }
+
+    // Host gone for good, the next one opens at the starting rate
+    unsigned long left = emuMillis();
+    if (!runUntil(atStartRate, 60000))
+    {
+        fprintf(stderr, "The sketch stayed at %lu baud with no host\n", Serial.baud());
+        failures++;
+    }
+    unsigned long idle = emuMillis() - left;
+    emuSetHostBaud(startRate);
+    if (!answered("(CON:0:SEQ)", "(ACK:SEQ:", 250))
+    {
+        fprintf(stderr, "No answer at %lu baud once the sketch returned to it\n", startRate);
+        failures++;
+    }
+    printf("Reconnect without reset, %d failed, back at %lu baud %.1f s after the host went quiet\n", failures,
+           startRate, idle / 1000.0);
+    return failures == 0 ? 0 : 1;
+}
+
+/*
+ * With switch events the driver has nothing to ask while the roof moves but reads the switches
+ * every heartbeat, which keeps the sketch at the faster rate through a long move so the event
+ * for its arrival can be read.
+ */
+static int longMove()
+{
+    char output[1024];
+    int failures = 0;
+    size_t length = 0;
+    unsigned long start;
+
+    emuSetTravel(EMU_LONG_TRAVEL);
+    if (!answered("(CON:0:SEQ)", "(ACK:SEQ:", 250) || !answered("(SET:EVENTS:ON)", "(ACK:EVENTS:ON)", 250) ||
+            !answered("(SET:BAUD:250000)", "(ACK:BAUD:250000)", 250))
+    {
+        fprintf(stderr, "Unable to set up the link at 250000 baud\n");
+        return 1;
+    }
+    emuSetHostBaud(250000);
+    if (!answered("(GET:BAUD:0)", "(ACK:BAUD:250000)", 250))
+    {
+        fprintf(stderr, "No answer at 250000 baud\n");
+        return 1;
+    }
+
+    emuInject("(SET:OPEN:ON)");
+    start = emuMillis();
+    while (!roofOpened() && emuMillis() - start < EMU_LONG_TRAVEL * 2)
+    {
+        if ((emuMillis() - start) % EMU_HEARTBEAT == EMU_HEARTBEAT - 1)
+            emuInject("(GET:OPENED:0)");
+        loop();
+        emuAdvance(1);
+        length += emuTakeOutput(output + length, sizeof(output) - length);
+    }
+    runUntil([] { return false; }, 100); // Time for the event to be sent
+    emuTakeOutput(output + length, sizeof(output) - length);
+    if (!roofOpened())
+    {
+        fprintf(stderr, "The roof did not open\n");
+        failures++;
+    }
+    if (strstr(output, "(EVT:OPENED:ON)") == nullptr)
+    {
+        fprintf(stderr, "No arrival event at 250000 baud in: %s\n", output);
+        failures++;
+    }
+    if (Serial.baud() != 250000)
+    {
+        fprintf(stderr, "The sketch dropped to %lu baud during the move\n", Serial.baud());
+        failures++;
+    }
+    printf("%.0f s move at 250000 baud, %d failed\n", (emuMillis() - start) / 1000.0, failures);
+    return failures == 0 ? 0 : 1;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *link = nullptr;
+    unsigned long travel = EMU_ROOF_TRAVEL;
+    bool realTime = false;
+    int cycles = 0;
+    int aborts = 0;
+    bool reconnecting = false;
+    bool longMoving = false;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "l:t:rc:a:nm")) != -1)
+    {
+        switch (opt)
+        {
+            case 'l': link = optarg; break;
+            case 't': travel = strtoul(optarg, nullptr, 10); break;
+            case 'r': realTime = true; break;
+            case 'c': cycles = atoi(optarg); break;
+            case 'a': aborts = atoi(optarg); break;
+            case 'n': reconnecting = true; break;
+            case 'm': longMoving = true; break;
+            default:
+                fprintf(stderr, "usage: %s [-l link] [-t travel ms] [-r] [-c cycles] [-a aborts] [-n] [-m]\n", argv[0]);
+                return 1;
+        }
+    }
+    emuSetTravel(travel);
+
+    if (cycles > 0)
+    {
+        emuAttachSerial(-1);
+        setup();
+        return cycle(cycles, travel);
+    }
+    if (aborts > 0)
+    {
+        emuAttachSerial(-1);
+        setup();
+        return abortMoves(aborts, travel);
+    }
+    if (reconnecting)
+    {
+        emuAttachSerial(-1);
+        setup();
+        startRate = Serial.baud();
+        return reconnect();
+    }
+    if (longMoving)
+    {
+        emuAttachSerial(-1);
+        setup();
+        return longMove();
+    }
+
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master < 0 || grantpt(master) < 0 || unlockpt(master) < 0)
+    {
+        perror("pseudo terminal");
+        return 1;
+    }
+    // Hold the port open so it survives the driver disconnecting
+    int slave = open(ptsname(master), O_RDWR | O_NOCTTY);
+    struct termios tio;
+    tcgetattr(slave, &tio);
+    cfmakeraw(&tio);
+    tcsetattr(slave, TCSANOW, &tio);
+    fcntl(master, F_SETFL, fcntl(master, F_GETFL) | O_NONBLOCK);
+    if (link != nullptr)
+    {
+        unlink(link);
+        if (symlink(ptsname(master), link) < 0)
+            perror(link);
+    }
+    printf("Controller emulator on %s\n", link != nullptr ? link : ptsname(master));
+    fflush(stdout);
+
+    signal(SIGINT, stop);
+    signal(SIGTERM, stop);
+    emuAttachSerial(master);
+    setup();
+
+    double realLast = realMillis();
+    double realCarry = 0;
+    while (running)
+    {
+        emuSetHostBaud(inoGetBaudRate(slave));
+        loop();
+        if (emuBusy() && !realTime)
+        {
+            emuAdvance(1);
+            realLast = realMillis();
+            continue;
+        }
+        struct pollfd pfd = { master, POLLIN, 0 };
+        poll(&pfd, 1, 1);
+        double realNow = realMillis();
+        realCarry += realNow - realLast;
+        realLast = realNow;
+        if (realCarry >= 1)
+        {
+            emuAdvance((unsigned long)realCarry);
+            realCarry -= (unsigned long)realCarry;
+        }
+    }
+    if (link != nullptr)
+        unlink(link);
+    close(slave);
+    close(master);
+    return 0;
+}
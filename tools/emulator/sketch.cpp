@@ -0,0 +1,27 @@
+/*******************************************************************************
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Library General Public
+ License version 2 as published by the Free Software Foundation.
+ .
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Library General Public License for more details.
+ .
+ You should have received a copy of the GNU Library General Public License
+ along with this library; see the file COPYING.LIB.  If not, write to
+ the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ Boston, MA 02110-1301, USA.
+*******************************************************************************/
+
+/*
+ * The controller sketch built for the host. The Arduino IDE declares the sketch functions
+ * ahead of use, the build generates the same declarations into sketch_prototypes.h.
+ */
+#include "Arduino.h"
+#include "emulator.h"
+#include "sketch_prototypes.h"
+
+#define ROOFRELAY EMU_RELAY_PIN
+
+#include "rolloffino-nano.ino"
@@ -0,0 +1,280 @@
+/*******************************************************************************
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Library General Public
+ License version 2 as published by the Free Software Foundation.
+ .
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Library General Public License for more details.
+ .
+ You should have received a copy of the GNU Library General Public License
+ along with this library; see the file COPYING.LIB.  If not, write to
+ the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ Boston, MA 02110-1301, USA.
+*******************************************************************************/
+
+
+/*
+ * End to end latency of the controller link.
+ * A stand-in controller answers on the master side of a pseudo terminal while InoLink drives
+ * CON, GET and SET requests through the slave side, as the driver does through the serial port.
+ * Reports round trip percentiles per request type and the system calls each request cost.
+ *
+ * By default the requests go straight to InoLink, which is the path of the driver's handshake,
+ * initialContact(). With -w the GET and SET requests go the way the driver's switch reads and
+ * button pushes do: posted to InoWorker as jobs, collected from its results once notifyFD() is
+ * readable and parsed as evaluateResponse() parses them. Neither includes the INDI property
+ * updates the driver makes from the result.
+ *
+ *   inobench [-n requests] [-d controller delay us] [-t] [-b] [-w]
+ *     -t  untagged requests, as an older controller without sequence ids
+ *     -b  binary framing
+ *     -w  switch reads and button pushes through the worker
+ */
+#include "inolink.h"
+#include "inoworker.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#define BENCH_VERSION "V0.4GT"
+
+static std::atomic<bool> running { true };
+
+/*
+ * Answer requests the way the controller firmware does. Responses echo any sequence id and
+ * the controller moves to binary frames once it has acknowledged (SET:BINARY:ON).
+ */
+static void fakeController(int fd, int delayUs)
+{
+    InoFrameBuffer input;
+    unsigned char body[MAXINOBUF];
+    unsigned char frame[MAXINOBUF];
+    char request[MAXINOBUF];
+    char response[MAXINOBUF];
+    char tag[16];
+    InoFrame parsed;
+    bool binary = false;
+    int len;
+
+    while (running)
+    {
+        if (input.fill(fd, 100) < 0)
+            break;
+        while (binary ? input.nextBinaryFrame(body, sizeof(body), &len) && inoDecodeBinary(body, len, request, sizeof(request))
+                      : input.nextFrame(request, sizeof(request)))
+        {
+            if (!inoParseFrame(request, strlen(request), &parsed) || parsed.target == INO_TARGET_OTHER)
+                continue;
+            tag[0] = '\0';
+            if (parsed.sequence >= 0)
+                snprintf(tag, sizeof(tag), "#%d", parsed.sequence);
+
+            const char *target = inoTargetNames[parsed.target];
+            if (parsed.command == INO_CMD_CON)
+                snprintf(response, sizeof(response), "(ACK%s:%s:%s)", tag, parsed.value.is("SEQ") ? "SEQ" : "0", BENCH_VERSION);
+            else if (parsed.command == INO_CMD_GET)
+                snprintf(response, sizeof(response), "(ACK%s:%s:%s)", tag, target,
+                         parsed.target == INO_TARGET_ALL ? "0100" : (parsed.target == INO_TARGET_CLOSED ? "ON" : "OFF"));
+            else
+                snprintf(response, sizeof(response), "(ACK%s:%s:ON)", tag, target);
+
+            if (delayUs > 0)
+                usleep(delayUs);
+            if (binary)
+            {
+                len = inoEncodeBinary(response, frame, sizeof(frame));
+                if (::write(fd, frame, len) < 0)
+                    return;
+            }
+            else if (::write(fd, response, strlen(response)) < 0)
+                return;
+            if (parsed.command == INO_CMD_SET && parsed.target == INO_TARGET_BINARY)
+                binary = true;
+        }
+    }
+}
+
+static double elapsedUs(const struct timespec &start, const struct timespec &end)
+{
+    return (end.tv_sec - start.tv_sec) * 1e6 + (end.tv_nsec - start.tv_nsec) / 1e3;
+}
+
+/*
+ * A job as pollRoofSwitches() or pushRoofButton() posts it, complete once its result is parsed
+ */
+static bool workerRequest(InoWorker &worker, const char *cmd, const char *target, const char *value, unsigned long *calls)
+{
+    InoJob job {};
+    InoResult result;
+    InoFrame frame;
+    struct pollfd pfd = { worker.notifyFD(), POLLIN, 0 };
+
+    InoWorker::addRequest(&job, cmd, target, value);
+    if (!worker.post(job, !strcmp(cmd, "SET")))
+        return false;
+    while (!worker.next(&result))
+    {
+        if (poll(&pfd, 1, MAXINOWAIT * 2000) <= 0)
+            return false;
+    }
+    *calls = result.stats.systemCalls;
+    return result.ok[0] && inoParseFrame(result.responses[0], strlen(result.responses[0]), &frame) &&
+           frame.command == INO_CMD_ACK;
+}
+
+static void report(const char *name, std::vector<double> &samples, unsigned long calls)
+{
+    if (samples.empty())
+        return;
+    std::sort(samples.begin(), samples.end());
+    size_t n = samples.size();
+    printf("%-4s %8zu %10.1f %10.1f %10.1f %10.2f\n", name, n, samples[n / 2], samples[(n * 99) / 100], samples[n - 1],
+           (double)calls / n);
+}
+
+int main(int argc, char *argv[])
+{
+    int count = 10000;
+    int delayUs = 0;
+    bool tagged = true;
+    bool binary = false;
+    bool worked = false;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:d:tbw")) != -1)
+    {
+        switch (opt)
+        {
+            case 'n': count = atoi(optarg); break;
+            case 'd': delayUs = atoi(optarg); break;
+            case 't': tagged = false; break;
+            case 'b': binary = true; break;
+            case 'w': worked = true; break;
+            default:
+                fprintf(stderr, "usage: %s [-n requests] [-d controller delay us] [-t] [-b] [-w]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (binary && !tagged)
+    {
+        fprintf(stderr, "Binary framing needs sequence ids\n");
+        return 1;
+    }
+
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master < 0 || grantpt(master) < 0 || unlockpt(master) < 0)
+    {
+        perror("pseudo terminal");
+        return 1;
+    }
+    int slave = open(ptsname(master), O_RDWR | O_NOCTTY);
+    if (slave < 0)
+    {
+        perror(ptsname(master));
+        return 1;
+    }
+    struct termios tio;
+    tcgetattr(slave, &tio);
+    cfmakeraw(&tio);
+    tcsetattr(slave, TCSANOW, &tio);
+
+    std::thread controller(fakeController, master, delayUs);
+
+    InoLink link;
+    char response[MAXINOBUF];
+    link.setDeviceName("inobench");
+    link.setPort(slave);
+    if (!link.request("CON", "0", tagged ? "SEQ" : "0", response))
+    {
+        fprintf(stderr, "No response from the stand-in controller\n");
+        return 1;
+    }
+    link.setSequenced(tagged);
+    if (binary)
+    {
+        if (!link.request("SET", "BINARY", "ON", response))
+            return 1;
+        link.setBinaryFraming(true);
+    }
+
+    // The mix a connected driver sends, mostly status polls
+    static const struct { const char *cmd, *target, *value; int type; } mix[] = {
+        { "GET", "OPENED", "0", 1 }, { "GET", "CLOSED", "0", 1 }, { "GET", "ALL", "0", 1 },
+        { "SET", "OPEN", "OFF", 2 }, { "CON", "0", "0", 0 },
+    };
+    static const char *typeNames[] = { "CON", "GET", "SET" };
+    std::vector<double> latency[3];
+    unsigned long calls[3] = { 0, 0, 0 };
+    int failures = 0;
+
+    // Once started the worker owns the link, its counters come back with each result
+    InoWorker worker;
+    unsigned long workerCalls = link.stats().systemCalls;
+    if (worked && !worker.start(&link))
+    {
+        fprintf(stderr, "Unable to start the link worker\n");
+        return 1;
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        const auto &req = mix[i % (sizeof(mix) / sizeof(mix[0]))];
+        struct timespec start, end;
+        unsigned long used;
+        bool ok;
+
+        if (worked && req.type == 0)
+            continue; // The handshake is not run through the worker
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (worked)
+        {
+            unsigned long after = workerCalls;
+            ok = workerRequest(worker, req.cmd, req.target, req.value, &after);
+            used = after - workerCalls;
+            workerCalls = after;
+        }
+        else
+        {
+            unsigned long before = link.stats().systemCalls;
+            ok = link.request(req.cmd, req.target, req.value, response);
+            used = link.stats().systemCalls - before;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        if (!ok)
+        {
+            failures++;
+            continue;
+        }
+        latency[req.type].push_back(elapsedUs(start, end));
+        calls[req.type] += used;
+    }
+    worker.stop();
+
+    InoLink::Stats totals = link.stats();
+    size_t sent = latency[0].size() + latency[1].size() + latency[2].size() + failures;
+    printf("%zu requests, %s %s framing, controller delay %d us%s\n", sent, tagged ? "tagged" : "untagged",
+           binary ? "binary" : "text", delayUs, worked ? ", through the worker" : "");
+    printf("%-4s %8s %10s %10s %10s %10s\n", "type", "count", "p50 us", "p99 us", "max us", "syscalls");
+    for (int type = 0; type < 3; type++)
+        report(typeNames[type], latency[type], calls[type]);
+    printf("bytes out %lu, bytes in %lu, failures %d\n", totals.bytesOut, totals.bytesIn, failures);
+
+    running = false;
+    controller.join();
+    close(slave);
+    close(master);
+    return failures == 0 ? 0 : 1;
+}
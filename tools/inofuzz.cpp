@@ -0,0 +1,142 @@
+/*******************************************************************************
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Library General Public
+ License version 2 as published by the Free Software Foundation.
+ .
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Library General Public License for more details.
+ .
+ You should have received a copy of the GNU Library General Public License
+ along with this library; see the file COPYING.LIB.  If not, write to
+ the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ Boston, MA 02110-1301, USA.
+*******************************************************************************/
+
+
+/*
+ * Fuzz target for the frame parser and the binary encoding, for libFuzzer:
+ *   inofuzz [corpus directory]
+ * Compilers without libFuzzer build a stand alone driver instead that runs the files given, or
+ * with none a run of random mutations of well formed frames.
+ */
+#include "inoframe.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#define FUZZ_CHECK(condition)                                                         \
+    do                                                                                \
+    {                                                                                 \
+        if (!(condition))                                                             \
+        {                                                                             \
+            fprintf(stderr, "%s:%d check failed: %s\n", __FILE__, __LINE__, #condition); \
+            abort();                                                                  \
+        }                                                                             \
+    } while (0)
+
+static bool inside(const InoText &part, const char *text, size_t len)
+{
+    return part.data >= text && part.data + part.len <= text + len;
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    const char *text = (const char *)data;
+    InoFrame frame;
+    InoFrame decoded;
+    const char *error = nullptr;
+
+    if (!inoParseFrame(text, size, &frame, &error))
+    {
+        FUZZ_CHECK(error != nullptr);
+        return 0;
+    }
+    FUZZ_CHECK(frame.command > INO_CMD_NONE && frame.command < INO_COMMANDS);
+    FUZZ_CHECK(frame.target >= INO_TARGET_OTHER && frame.target < INO_TARGETS);
+    FUZZ_CHECK(frame.sequence >= -1 && frame.sequence <= 255);
+    FUZZ_CHECK(inside(frame.targetText, text, size) && frame.targetText.len > 0);
+    FUZZ_CHECK(inside(frame.value, text, size) && frame.value.len > 0);
+    FUZZ_CHECK(memchr(frame.value.data, ')', frame.value.len) == nullptr);
+
+    // Anything that parses with a known target survives the trip through a binary frame
+    char terminated[512];
+    unsigned char binary[512];
+    char back[512];
+    if (frame.target == INO_TARGET_OTHER || size >= sizeof(terminated))
+        return 0;
+    memcpy(terminated, text, size);
+    terminated[size] = '\0';
+    int binaryLen = inoEncodeBinary(terminated, binary, sizeof(binary));
+    if (binaryLen == 0)
+        return 0;
+    FUZZ_CHECK(binary[0] == INO_BIN_SYNC && binary[1] + INO_BIN_OVERHEAD == binaryLen);
+    FUZZ_CHECK(inoCrc8(binary + 1, binary[1] + 1) == binary[binaryLen - 1]);
+    FUZZ_CHECK(inoDecodeBinary(binary + 2, binary[1], back, sizeof(back)));
+    FUZZ_CHECK(inoParseFrame(back, strlen(back), &decoded));
+    FUZZ_CHECK(decoded.command == frame.command && decoded.target == frame.target);
+    FUZZ_CHECK(frame.sequence < 0 || decoded.sequence == frame.sequence);
+    FUZZ_CHECK(decoded.value.len == frame.value.len && memcmp(decoded.value.data, frame.value.data, frame.value.len) == 0);
+    return 0;
+}
+
+#ifdef INO_FUZZ_MAIN
+static const char *seeds[] = {
+    "(ACK:OPENED:ON)", "(ACK#12:ALL:1000)", "(NAK#3:ERROR:OFF:Relay busy with previous command)",
+    "(EVT:CLOSED:OFF)", "(ACK:SEQ:V0.4GT)", "(GET#255:BAUD:0)", "(SET:OPEN:ON)",
+};
+
+int main(int argc, char *argv[])
+{
+    uint8_t input[256];
+    size_t size;
+
+    if (argc > 1)
+    {
+        for (int i = 1; i < argc; i++)
+        {
+            FILE *file = fopen(argv[i], "rb");
+            if (file == nullptr)
+                continue;
+            size = fread(input, 1, sizeof(input), file);
+            fclose(file);
+            LLVMFuzzerTestOneInput(input, size);
+        }
+        return 0;
+    }
+
+    // Flip, insert and delete bytes of the seeds
+    srand(1);
+    for (int run = 0; run < 1000000; run++)
+    {
+        const char *seed = seeds[run % (sizeof(seeds) / sizeof(seeds[0]))];
+        size = strlen(seed);
+        memcpy(input, seed, size);
+        for (int edits = rand() % 4; edits > 0 && size > 0; edits--)
+        {
+            size_t at = rand() % size;
+            switch (rand() % 3)
+            {
+                case 0:
+                    input[at] = (rand() % 2) ? "():#01ONF"[rand() % 9] : rand() % 256;
+                    break;
+                case 1:
+                    memmove(input + at + 1, input + at, size - at);
+                    input[at] = "():#0"[rand() % 5];
+                    size++;
+                    break;
+                default:
+                    memmove(input + at, input + at + 1, size - at - 1);
+                    size--;
+                    break;
+            }
+        }
+        LLVMFuzzerTestOneInput(input, size);
+    }
+    printf("1000000 mutated frames checked\n");
+    return 0;
+}
+#endif
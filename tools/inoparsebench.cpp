@@ -0,0 +1,96 @@
+/*******************************************************************************
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Library General Public
+ License version 2 as published by the Free Software Foundation.
+ .
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Library General Public License for more details.
+ .
+ You should have received a copy of the GNU Library General Public License
+ along with this library; see the file COPYING.LIB.  If not, write to
+ the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ Boston, MA 02110-1301, USA.
+*******************************************************************************/
+
+
+/*
+ * Microbenchmark of the frame parser, nanoseconds per frame for well formed and malformed frames.
+ * The strtok and strcpy splitting it replaced is timed on the well formed frames for comparison,
+ * it cannot be given the malformed ones.
+ *   inoparsebench [iterations]
+ */
+#include "inoframe.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+static const char *wellFormed[] = {
+    "(ACK:OPENED:ON)", "(ACK#12:ALL:1000)", "(NAK#3:ERROR:OFF:Relay busy with previous command, command ignored)",
+    "(EVT:CLOSED:OFF)", "(ACK:SEQ:V0.4GT)", "(ACK#200:BAUD:250000)",
+};
+static const char *malformed[] = {
+    "(ACK)", "(ACK:OPENED)", "ACK:OPENED:ON)", "(XYZ:OPENED:ON)", "(ACK#999:OPENED:ON)", "(ACK:OPENED:)",
+};
+#define FRAMES(list) (int)(sizeof(list) / sizeof(list[0]))
+
+static double nowNs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1e9 + now.tv_nsec;
+}
+
+static volatile size_t sink;
+
+static double parse(const char **frames, int count, size_t *lengths, long iterations)
+{
+    InoFrame frame;
+    double start = nowNs();
+    for (long i = 0; i < iterations; i++)
+    {
+        int n = i % count;
+        if (inoParseFrame(frames[n], lengths[n], &frame))
+            sink = frame.value.len;
+    }
+    return (nowNs() - start) / iterations;
+}
+
+static double splitWithStrtok(const char **frames, int count, long iterations)
+{
+    char buffer[256];
+    char inoCmd[16], inoTarget[16], inoVal[128];
+    double start = nowNs();
+    for (long i = 0; i < iterations; i++)
+    {
+        strcpy(buffer, frames[i % count]);
+        strcpy(inoCmd, strtok(buffer, "(:"));
+        strcpy(inoTarget, strtok(nullptr, ":"));
+        strcpy(inoVal, strtok(nullptr, ")"));
+        if (strchr(inoCmd, '#') != nullptr)
+            *strchr(inoCmd, '#') = '\0';
+        sink = strlen(inoVal) + (strcmp(inoCmd, "NAK") == 0);
+    }
+    return (nowNs() - start) / iterations;
+}
+
+int main(int argc, char *argv[])
+{
+    long iterations = (argc > 1) ? atol(argv[1]) : 10000000;
+    size_t wellFormedLen[FRAMES(wellFormed)];
+    size_t malformedLen[FRAMES(malformed)];
+
+    for (int i = 0; i < FRAMES(wellFormed); i++)
+        wellFormedLen[i] = strlen(wellFormed[i]);
+    for (int i = 0; i < FRAMES(malformed); i++)
+        malformedLen[i] = strlen(malformed[i]);
+
+    printf("%ld iterations\n", iterations);
+    printf("inoParseFrame well formed  %6.1f ns\n", parse(wellFormed, FRAMES(wellFormed), wellFormedLen, iterations));
+    printf("inoParseFrame malformed    %6.1f ns\n", parse(malformed, FRAMES(malformed), malformedLen, iterations));
+    printf("strtok/strcpy well formed  %6.1f ns\n", splitWithStrtok(wellFormed, FRAMES(wellFormed), iterations));
+    return 0;
+}
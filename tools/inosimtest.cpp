@@ -0,0 +1,282 @@
+/*******************************************************************************
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Library General Public
+ License version 2 as published by the Free Software Foundation.
+ .
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Library General Public License for more details.
+ .
+ You should have received a copy of the GNU Library General Public License
+ along with this library; see the file COPYING.LIB.  If not, write to
+ the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ Boston, MA 02110-1301, USA.
+*******************************************************************************/
+
+
+/*
+ * Simulated roof scenarios, run by ctest. Each connects a roof to the simulated controller with
+ * its clock sped up and makes the requests a client would, running the INDI event loop until the
+ * roof gets where it should or the real time allowed runs out.
+ *
+ *   inosimtest <scenario>
+ *     cycles   the roof opens and closes, reaching Unparked and Parked each time
+ *     slow     the same over a slow link
+ *     stuck    a switch that never changes, the move times out
+ *     both     both switches on, no move is started
+ *     nak      the controller rejects the move
+ *     drop     the controller stops answering, the roof reconnects once it answers again
+ *     abort    the roof is stopped part way, then an abort with it stationary is rejected
+ *
+ * Prints the scenario and whether it passed, exits non-zero if it did not.
+ */
+#include "rolloffnano.h"
+#include "eventloop.h"
+
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <functional>
+
+#define TEST_ROOF 2           // Roof number of the device under test, apart from the one the driver makes
+#define TEST_SCALE 100        // Virtual seconds to each real one, slow enough that a busy machine does not time a move out
+#define TEST_ABORT_SCALE 10   // Slow enough to stop the roof part way
+#define TEST_CYCLES 200       // Opens and closes in the cycles scenario
+#define TEST_SLACK 2000       // Real milliseconds allowed on top of a move's timeout
+#define TEST_RECONNECT 10000  // Real milliseconds allowed for a reconnect, its back off is not scaled
+
+class RollOffNanoSimTest
+{
+  public:
+    RollOffNanoSimTest() : roof(TEST_ROOF) {}
+
+    bool cycles();
+    bool slow();
+    bool stuck();
+    bool both();
+    bool nak();
+    bool drop();
+    bool abort();
+
+  private:
+    bool connect(double scale);
+    void request(const char *property, const char *element, ISState state = ISS_ON);
+    bool waitFor(const std::function<bool()> &done, int ms);
+    bool move(const char *element, INDI::Dome::DomeState state);
+    int moveAllowed() const;
+    unsigned long relayRequests() const;
+    bool fail(const char *what);
+
+    RollOffNano roof;
+    double scale { 1 };
+};
+
+bool RollOffNanoSimTest::fail(const char *what)
+{
+    fprintf(stderr, "FAILED: %s\n", what);
+    return false;
+}
+
+void RollOffNanoSimTest::request(const char *property, const char *element, ISState state)
+{
+    char name[MAXINDINAME];
+    char *names[] = { name };
+    ISState states[] = { state };
+
+    snprintf(name, sizeof(name), "%s", element);
+    roof.ISNewSwitch(roof.getDeviceName(), property, states, names, 1);
+}
+
+// Run the event loop until done or ms real milliseconds have passed
+bool RollOffNanoSimTest::waitFor(const std::function<bool()> &done, int ms)
+{
+    struct timespec start, now;
+    int never = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (!done())
+    {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if ((now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000 >= ms)
+            return false;
+        IEDeferLoop(5, &never);
+    }
+    return true;
+}
+
+// Real milliseconds for a move to reach its switch or time out, with slack for a loaded machine
+int RollOffNanoSimTest::moveAllowed() const
+{
+    return (int)(1000 * roof.RoofTimeoutN[0].value / scale) + TEST_SLACK;
+}
+
+unsigned long RollOffNanoSimTest::relayRequests() const
+{
+    return roof.inoSim.stats().latency[InoLink::LATENCY_SET].total;
+}
+
+/*
+ * Connect in simulation and start from the roof parked, as the simulated controller starts closed
+ */
+bool RollOffNanoSimTest::connect(double timeScale)
+{
+    double values[] = { timeScale };
+    char name[] = "SIM_TIME_SCALE";
+    char *names[] = { name };
+
+    scale = timeScale;
+    roof.ISGetProperties(nullptr);
+    request("SIMULATION", "ENABLE");
+    roof.ISNewNumber(roof.getDeviceName(), "SIMULATION_CLOCK", values, names, 1);
+    request("CONNECTION", "CONNECT");
+    if (!roof.isConnected() || !roof.contactEstablished)
+        return fail("no contact with the simulated controller");
+    if (!waitFor([this] { return roof.switchesValid; }, TEST_SLACK))
+        return fail("the switches were not read after connecting");
+    if (!move("PARK", INDI::Dome::DOME_PARKED))
+        return fail("the roof did not start parked");
+    return true;
+}
+
+bool RollOffNanoSimTest::move(const char *element, INDI::Dome::DomeState state)
+{
+    request("DOME_PARK", element);
+    return waitFor([this, state] { return roof.getDomeState() == state; }, moveAllowed());
+}
+
+bool RollOffNanoSimTest::cycles()
+{
+    if (!connect(TEST_SCALE))
+        return false;
+    for (int cycle = 0; cycle < TEST_CYCLES; cycle++)
+    {
+        if (!move("UNPARK", INDI::Dome::DOME_UNPARKED))
+            return fail("the roof did not reach Unparked");
+        if (roof.fullyOpenedLimitSwitch != ISS_ON || roof.roofTimedOut != RollOffNano::EXPIRED_CLEAR)
+            return fail("the roof was unparked without reaching its opened switch");
+        if (!move("PARK", INDI::Dome::DOME_PARKED))
+            return fail("the roof did not reach Parked");
+        if (roof.fullyClosedLimitSwitch != ISS_ON || roof.roofTimedOut != RollOffNano::EXPIRED_CLEAR)
+            return fail("the roof was parked without reaching its closed switch");
+    }
+    return true;
+}
+
+bool RollOffNanoSimTest::slow()
+{
+    if (!connect(TEST_SCALE))
+        return false;
+    request("SIMULATION_FAULTS", "FAULT_SLOW_LINK");
+    if (!move("UNPARK", INDI::Dome::DOME_UNPARKED))
+        return fail("the roof did not reach Unparked over the slow link");
+    if (!move("PARK", INDI::Dome::DOME_PARKED))
+        return fail("the roof did not reach Parked over the slow link");
+    return true;
+}
+
+bool RollOffNanoSimTest::stuck()
+{
+    if (!connect(TEST_SCALE))
+        return false;
+    request("SIMULATION_FAULTS", "FAULT_STUCK_SWITCH");
+    request("DOME_PARK", "UNPARK");
+    if (!waitFor([this] { return roof.roofTimedOut == RollOffNano::EXPIRED_OPEN; }, moveAllowed()))
+        return fail("the move did not time out");
+    if (roof.getDomeState() != INDI::Dome::DOME_IDLE)
+        return fail("the roof was not left idle by the timeout");
+    return true;
+}
+
+bool RollOffNanoSimTest::both()
+{
+    unsigned long relays;
+
+    if (!connect(TEST_SCALE))
+        return false;
+    request("SIMULATION_FAULTS", "FAULT_BOTH_SWITCHES");
+    if (!waitFor([this] { return roof.fullyOpenedLimitSwitch == ISS_ON && roof.fullyClosedLimitSwitch == ISS_ON; },
+                 TEST_SLACK))
+        return fail("both switches were not read as on");
+    relays = relayRequests();
+    request("DOME_PARK", "UNPARK");
+    request("DOME_PARK", "PARK");
+    waitFor([] { return false; }, 100);
+    if (relayRequests() != relays || roof.roofOpening || roof.roofClosing)
+        return fail("the roof was set moving with both switches on");
+    return true;
+}
+
+bool RollOffNanoSimTest::nak()
+{
+    if (!connect(TEST_SCALE))
+        return false;
+    request("SIMULATION_FAULTS", "FAULT_NAK");
+    if (!move("UNPARK", INDI::Dome::DOME_ERROR))
+        return fail("the rejected move did not leave the roof in error");
+    return true;
+}
+
+bool RollOffNanoSimTest::drop()
+{
+    if (!connect(TEST_SCALE))
+        return false;
+    request("SIMULATION_FAULTS", "FAULT_DROP_RESPONSE");
+    if (!move("UNPARK", INDI::Dome::DOME_ERROR))
+        return fail("the unanswered move did not leave the roof in error");
+    if (!waitFor([this] { return !roof.contactEstablished; }, TEST_SLACK))
+        return fail("the lost controller was not noticed");
+    request("SIMULATION_FAULTS", "FAULT_DROP_RESPONSE", ISS_OFF);
+    if (!waitFor([this] { return roof.contactEstablished && roof.switchesValid; }, TEST_RECONNECT))
+        return fail("the roof did not reconnect once the controller answered again");
+    if (!move("PARK", INDI::Dome::DOME_PARKED))
+        return fail("the roof did not reach Parked after reconnecting");
+    return true;
+}
+
+bool RollOffNanoSimTest::abort()
+{
+    if (!connect(TEST_ABORT_SCALE))
+        return false;
+    request("DOME_PARK", "UNPARK");
+    if (!waitFor([this] { return roof.switchesValid && roof.fullyClosedLimitSwitch == ISS_OFF; }, moveAllowed()))
+        return fail("the roof did not leave its closed switch");
+    request("DOME_ABORT_MOTION", "ABORT");
+    if (!waitFor([this] { return roof.LinkN[RollOffNano::LINK_ABORT].value > 0; }, TEST_SLACK))
+        return fail("the abort was not acknowledged");
+    if (!waitFor([this] { return roof.getDomeState() == INDI::Dome::DOME_IDLE && roof.switchesValid; }, TEST_SLACK))
+        return fail("the roof was not left idle by the abort");
+    if (roof.fullyOpenedLimitSwitch == ISS_ON || roof.fullyClosedLimitSwitch == ISS_ON)
+        return fail("the roof carried on to a switch after the abort");
+    request("DOME_ABORT_MOTION", "ABORT");
+    if (!waitFor([this] { return roof.AbortSP.s == IPS_ALERT; }, TEST_SLACK))
+        return fail("an abort with the roof stationary was not rejected");
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    struct
+    {
+        const char *name;
+        bool (RollOffNanoSimTest::*run)();
+    } scenarios[] = {
+        { "cycles", &RollOffNanoSimTest::cycles }, { "slow", &RollOffNanoSimTest::slow },
+        { "stuck", &RollOffNanoSimTest::stuck }, { "both", &RollOffNanoSimTest::both },
+        { "nak", &RollOffNanoSimTest::nak }, { "drop", &RollOffNanoSimTest::drop },
+        { "abort", &RollOffNanoSimTest::abort },
+    };
+
+    for (const auto &scenario : scenarios)
+    {
+        if (argc == 2 && !strcmp(argv[1], scenario.name))
+        {
+            RollOffNanoSimTest test;
+            bool passed = (test.*scenario.run)();
+            fprintf(stderr, "%s: %s\n", scenario.name, passed ? "passed" : "failed");
+            return passed ? 0 : 1;
+        }
+    }
+    fprintf(stderr, "Usage: inosimtest <cycles|slow|stuck|both|nak|drop|abort>\n");
+    return 2;
+}
@@ -0,0 +1,482 @@
+/*******************************************************************************
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Library General Public
+ License version 2 as published by the Free Software Foundation.
+ .
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Library General Public License for more details.
+ .
+ You should have received a copy of the GNU Library General Public License
+ along with this library; see the file COPYING.LIB.  If not, write to
+ the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ Boston, MA 02110-1301, USA.
+*******************************************************************************/
+
+
+/*
+ * Soak test of the driver as an INDI server runs it, for faults that only show after days or weeks
+ * of uptime. A roof is connected to a controller, or to the emulator's pseudo terminal, and kept
+ * cycling by park and unpark requests as a client would make them, with a reconnect forced now
+ * and then as a dropped USB link would. The driver's own timers, link worker, publisher, config
+ * saves and reconnect thread all run as they would in the server. Each report interval prints the
+ * transaction rate and the timeout, NAK and resync rates from the driver's link counters, resident
+ * memory and its growth since the first report, open file descriptors, and how late a probe timer
+ * on the driver's event loop fired against its schedule.
+ *
+ *   inosoak [-p port | -e emulator] [-d seconds] [-i report seconds] [-r reconnect seconds]
+ *     -p  port of the controller, or of a pseudo terminal standing in for it
+ *     -e  start the controller emulator given, inoemu, and soak its pseudo terminal
+ *     -d  seconds to run for, default until interrupted
+ *     -i  seconds between reports, default SOAK_REPORT
+ *     -r  seconds between forced reconnects, default SOAK_RECONNECT, 0 for none
+ *
+ * The emulator skips time while the roof moves, so a day of roof cycles runs in minutes of real
+ * time. The config the driver saves goes to a scratch HOME rather than the user's ~/.indi. Exits
+ * non-zero if a move failed, a reconnect did not come back, or if memory or file descriptors grew
+ * after the first report by more than SOAK_RSS_SLACK or at all.
+ */
+#include "rolloffnano.h"
+#include "eventloop.h"
+
+#include <algorithm>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define SOAK_ROOF 2             // Roof number of the device soaked, apart from the one the driver makes
+#define SOAK_REPORT 60          // Seconds between reports
+#define SOAK_RECONNECT 300      // Seconds between forced reconnects
+#define SOAK_RECONNECT_WAIT 60  // Real seconds allowed for a reconnect, covering its back off
+#define SOAK_PROBE 250          // Milliseconds between firings of the probe timer
+#define SOAK_SLACK 10           // Real seconds allowed on top of the roof's timeout for a move
+#define SOAK_CONTACT 5000       // Milliseconds for the emulator to start
+#define SOAK_RSS_SLACK 1024     // Kilobytes resident memory may grow after the first report
+
+static volatile sig_atomic_t running = 1;
+
+static void stop(int)
+{
+    running = 0;
+}
+
+static double realSeconds()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static long residentKB()
+{
+    long pages = 0;
+    long resident = 0;
+    FILE *statm = fopen("/proc/self/statm", "r");
+
+    if (statm == nullptr)
+        return 0;
+    if (fscanf(statm, "%ld %ld", &pages, &resident) != 2)
+        resident = 0;
+    fclose(statm);
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static int openFiles()
+{
+    DIR *dir = opendir("/proc/self/fd");
+    int count = -3; // ".", ".." and the directory being read
+
+    if (dir == nullptr)
+        return 0;
+    while (readdir(dir) != nullptr)
+        count++;
+    closedir(dir);
+    return count;
+}
+
+// Start the emulator on a pseudo terminal reached through link, waiting for it to appear
+static pid_t startEmulator(const char *emulator, const char *link)
+{
+    struct stat info;
+    pid_t pid;
+
+    unlink(link);
+    pid = fork();
+    if (pid == 0)
+    {
+        int quiet = open("/dev/null", O_WRONLY);
+        dup2(quiet, STDOUT_FILENO);
+        execl(emulator, emulator, "-l", link, (char *)nullptr);
+        perror(emulator);
+        _exit(127);
+    }
+    for (int waited = 0; pid > 0 && waited < SOAK_CONTACT; waited += 10)
+    {
+        if (stat(link, &info) == 0)
+            return pid;
+        usleep(10000);
+    }
+    fprintf(stderr, "The emulator %s did not start\n", emulator);
+    return -1;
+}
+
+// Keep the driver's config out of the user's ~/.indi, in a directory removed at the end
+static bool scratchHome(char *home, size_t size)
+{
+    char indi[128];
+
+    snprintf(home, size, "/tmp/inosoak-home-XXXXXX");
+    if (mkdtemp(home) == nullptr)
+        return false;
+    snprintf(indi, sizeof(indi), "%s/.indi", home);
+    if (mkdir(indi, 0700) < 0)
+        return false;
+    setenv("HOME", home, 1);
+    return true;
+}
+
+static void removeScratch(const char *home)
+{
+    char path[512];
+    struct dirent *entry;
+    DIR *dir;
+
+    snprintf(path, sizeof(path), "%s/.indi", home);
+    dir = opendir(path);
+    while (dir != nullptr && (entry = readdir(dir)) != nullptr)
+    {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+        snprintf(path, sizeof(path), "%s/.indi/%s", home, entry->d_name);
+        unlink(path);
+    }
+    if (dir != nullptr)
+        closedir(dir);
+    snprintf(path, sizeof(path), "%s/.indi", home);
+    rmdir(path);
+    rmdir(home);
+}
+
+/*
+ * Drives the roof as a client would and watches it, from the INDI event loop the driver runs on
+ */
+class RollOffNanoSoak
+{
+  public:
+    RollOffNanoSoak() : roof(SOAK_ROOF) {}
+
+    bool connect(const char *port);
+    void disconnect();
+    void step(double now);
+    bool steady() const { return reconnectStart < 0; }
+    void report(double elapsed, double interval, long rss, long rssBase, int fds);
+    void summary(double elapsed);
+    void startProbe();
+
+    double reconnectInterval { SOAK_RECONNECT };
+    unsigned long moveFailures { 0 };
+    unsigned long reconnectFailures { 0 };
+
+  private:
+    void request(const char *property, const char *element);
+    void counters(double values[]);
+    void probe();
+    static void probeHelper(void *context);
+
+    RollOffNano roof;
+    INDI::Dome::DomeState target { INDI::Dome::DOME_IDLE }; // State the move in progress is heading for
+    double moveStart { 0 };
+    double reconnectStart { -1 };
+    double nextReconnect { 0 };
+    unsigned long cycles { 0 };
+    unsigned long reconnects { 0 };
+    double totals[RollOffNano::COUNT_RESYNCS + 1] {};  // Link counters summed over the sessions
+    double session[RollOffNano::COUNT_RESYNCS + 1] {}; // As last seen in the present session
+    double reported[RollOffNano::COUNT_RESYNCS + 1] {};
+    double probeDue { 0 };
+    InoLatency late {};         // How late the probe timer fired
+    double lateMax { 0 };
+};
+
+void RollOffNanoSoak::request(const char *property, const char *element)
+{
+    char name[MAXINDINAME];
+    char *names[] = { name };
+    ISState states[] = { ISS_ON };
+
+    snprintf(name, sizeof(name), "%s", element);
+    roof.ISNewSwitch(roof.getDeviceName(), property, states, names, 1);
+}
+
+bool RollOffNanoSoak::connect(const char *port)
+{
+    char text[MAXINDINAME];
+    char name[] = "PORT";
+    char *texts[] = { text };
+    char *names[] = { name };
+    int never = 0;
+
+    snprintf(text, sizeof(text), "%s", port);
+    roof.ISGetProperties(nullptr);
+    roof.ISNewText(roof.getDeviceName(), "DEVICE_PORT", texts, names, 1);
+    request("DEVICE_BAUD_RATE", "38400");
+    request("CONNECTION", "CONNECT");
+    if (!roof.isConnected() || !roof.contactEstablished)
+        return false;
+    for (int waited = 0; !roof.switchesValid && waited < SOAK_CONTACT; waited += 10)
+        IEDeferLoop(10, &never);
+    nextReconnect = realSeconds() + reconnectInterval;
+    printf("Controller %s, %s framing, %.0f baud, switch events %s\n",
+           roof.inoLink.isSequenced() ? "sequenced" : "unsequenced", roof.inoLink.isBinaryFraming() ? "binary" : "text",
+           roof.LinkN[RollOffNano::LINK_BAUD].value, roof.switchEvents ? "on" : "off");
+    return roof.switchesValid;
+}
+
+void RollOffNanoSoak::disconnect()
+{
+    request("CONNECTION", "DISCONNECT");
+}
+
+/*
+ * Link counters summed over every session, each reconnect starts the link's own counts again
+ */
+void RollOffNanoSoak::counters(double values[])
+{
+    for (int i = RollOffNano::COUNT_TRANSACTIONS; i <= RollOffNano::COUNT_RESYNCS; i++)
+    {
+        double value = roof.LinkCountersN[i].value;
+        totals[i] += (value >= session[i]) ? value - session[i] : value;
+        session[i] = value;
+        values[i] = totals[i];
+    }
+}
+
+/*
+ * What a client keeping the roof busy does: park it once unparked and unpark it once parked,
+ * waiting out a reconnect every so often
+ */
+void RollOffNanoSoak::step(double now)
+{
+    INDI::Dome::DomeState state = roof.getDomeState();
+
+    if (reconnectStart >= 0)
+    {
+        if (roof.contactEstablished && !roof.reconnecting() && roof.switchesValid)
+        {
+            reconnectStart = -1;
+            nextReconnect = now + reconnectInterval; // Leaving the roof time to move between them
+        }
+        else if (now - reconnectStart > SOAK_RECONNECT_WAIT)
+        {
+            fprintf(stderr, "The roof did not reconnect within %d seconds\n", SOAK_RECONNECT_WAIT);
+            reconnectFailures++;
+            reconnectStart = -1;
+            nextReconnect = now + reconnectInterval;
+        }
+        return;
+    }
+    if (target != INDI::Dome::DOME_IDLE)
+    {
+        if (state == target)
+        {
+            cycles += (target == INDI::Dome::DOME_PARKED) ? 1 : 0;
+            target = INDI::Dome::DOME_IDLE;
+        }
+        else if (state == INDI::Dome::DOME_ERROR || now - moveStart > roof.RoofTimeoutN[0].value + SOAK_SLACK)
+        {
+            fprintf(stderr, "Roof did not reach %s, dome state %d\n",
+                    target == INDI::Dome::DOME_PARKED ? "Parked" : "Unparked", state);
+            moveFailures++;
+            target = INDI::Dome::DOME_IDLE;
+        }
+        return;
+    }
+    if (reconnectInterval > 0 && now >= nextReconnect)
+    {
+        reconnectStart = now;
+        reconnects++;
+        roof.startReconnect();
+        return;
+    }
+    target = (state == INDI::Dome::DOME_PARKED) ? INDI::Dome::DOME_UNPARKED : INDI::Dome::DOME_PARKED;
+    moveStart = now;
+    request("DOME_PARK", target == INDI::Dome::DOME_PARKED ? "PARK" : "UNPARK");
+}
+
+/*
+ * A timer sharing the event loop with the driver's, anything the driver does that holds up the
+ * loop makes it late
+ */
+void RollOffNanoSoak::startProbe()
+{
+    probeDue = realSeconds() + SOAK_PROBE / 1000.0;
+    IEAddTimer(SOAK_PROBE, probeHelper, this);
+}
+
+void RollOffNanoSoak::probe()
+{
+    double lateMs = std::max((realSeconds() - probeDue) * 1000, 0.0);
+
+    late.record((long)(lateMs * 1000));
+    lateMax = std::max(lateMax, lateMs);
+    startProbe();
+}
+
+void RollOffNanoSoak::probeHelper(void *context)
+{
+    static_cast<RollOffNanoSoak *>(context)->probe();
+}
+
+void RollOffNanoSoak::report(double elapsed, double interval, long rss, long rssBase, int fds)
+{
+    double values[RollOffNano::COUNT_RESYNCS + 1];
+    double transactions;
+
+    counters(values);
+    transactions = std::max(values[RollOffNano::COUNT_TRANSACTIONS] - reported[RollOffNano::COUNT_TRANSACTIONS], 1.0);
+    printf("%8.0f %9.1f %8lu %5lu %6lu %8.3f %8.3f %8.3f %8ld %+7ld %4d %7.2f %7.2f %7.2f\n", elapsed,
+           (values[RollOffNano::COUNT_TRANSACTIONS] - reported[RollOffNano::COUNT_TRANSACTIONS]) / interval, cycles,
+           moveFailures, reconnects,
+           1000.0 * (values[RollOffNano::COUNT_TIMEOUTS] - reported[RollOffNano::COUNT_TIMEOUTS]) / transactions,
+           1000.0 * (values[RollOffNano::COUNT_NAKS] - reported[RollOffNano::COUNT_NAKS]) / transactions,
+           1000.0 * (values[RollOffNano::COUNT_RESYNCS] - reported[RollOffNano::COUNT_RESYNCS]) / transactions, rss,
+           rss - rssBase, fds, late.percentile(0.5), late.percentile(0.99), lateMax);
+    fflush(stdout);
+    std::copy(values, values + RollOffNano::COUNT_RESYNCS + 1, reported);
+}
+
+void RollOffNanoSoak::summary(double elapsed)
+{
+    double values[RollOffNano::COUNT_RESYNCS + 1];
+
+    counters(values);
+    printf("%.0f s, %.0f transactions at %.1f/s, %lu cycles, %lu failed moves, %lu reconnects, %lu not back, "
+           "%.0f timeouts, %.0f NAKs, %.0f malformed, %.0f resyncs\n", elapsed,
+           values[RollOffNano::COUNT_TRANSACTIONS], values[RollOffNano::COUNT_TRANSACTIONS] / std::max(elapsed, 1e-3),
+           cycles, moveFailures, reconnects, reconnectFailures, values[RollOffNano::COUNT_TIMEOUTS],
+           values[RollOffNano::COUNT_NAKS], values[RollOffNano::COUNT_MALFORMED], values[RollOffNano::COUNT_RESYNCS]);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *port = nullptr;
+    const char *emulator = nullptr;
+    char emulatorLink[64];
+    char home[64];
+    double duration = 0;
+    double interval = SOAK_REPORT;
+    double reconnectInterval = SOAK_RECONNECT;
+    pid_t emulatorPid = -1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "p:e:d:i:r:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'p': port = optarg; break;
+            case 'e': emulator = optarg; break;
+            case 'd': duration = atof(optarg); break;
+            case 'i': interval = std::max(atof(optarg), 1.0); break;
+            case 'r': reconnectInterval = std::max(atof(optarg), 0.0); break;
+            default:
+                fprintf(stderr, "usage: %s [-p port | -e emulator] [-d seconds] [-i report seconds] [-r reconnect seconds]\n",
+                        argv[0]);
+                return 1;
+        }
+    }
+    if ((port == nullptr) == (emulator == nullptr))
+    {
+        fprintf(stderr, "Give either the port of a controller or the emulator to start\n");
+        return 1;
+    }
+    if (!scratchHome(home, sizeof(home)))
+    {
+        perror("scratch HOME");
+        return 1;
+    }
+    signal(SIGINT, stop);
+    signal(SIGTERM, stop);
+    signal(SIGPIPE, SIG_IGN);
+    if (emulator != nullptr)
+    {
+        snprintf(emulatorLink, sizeof(emulatorLink), "/tmp/inosoak-%d", (int)getpid());
+        emulatorPid = startEmulator(emulator, emulatorLink);
+        if (emulatorPid < 0)
+        {
+            removeScratch(home);
+            return 1;
+        }
+        port = emulatorLink;
+    }
+
+    RollOffNanoSoak soak;
+    soak.reconnectInterval = reconnectInterval;
+    if (!soak.connect(port))
+    {
+        fprintf(stderr, "No contact with the controller on %s\n", port);
+        soak.disconnect();
+        if (emulatorPid > 0)
+            kill(emulatorPid, SIGTERM);
+        removeScratch(home);
+        return 1;
+    }
+
+    printf("%8s %9s %8s %5s %6s %8s %8s %8s %8s %7s %4s %7s %7s %7s\n", "seconds", "trans/s", "cycles", "fail", "recon",
+           "tmo/1k", "nak/1k", "rsync/1k", "rss kB", "growth", "fds", "late50", "late99", "lateMax");
+    double start = realSeconds();
+    double nextReport = start + interval;
+    double lastReport = start;
+    long rssBase = 0;
+    long rssPeak = 0;
+    int fdsBase = -1;
+    int fdsPeak = 0;
+    int never = 0;
+
+    soak.startProbe();
+    while (running && (duration <= 0 || realSeconds() - start < duration))
+    {
+        IEDeferLoop(10, &never);
+        double now = realSeconds();
+        soak.step(now);
+        // Not in the middle of a reconnect, whose thread, pipe and port come and go
+        if (now >= nextReport && soak.steady())
+        {
+            long rss = residentKB();
+            int fds = openFiles();
+            if (fdsBase < 0)
+            {
+                rssBase = rss;
+                fdsBase = fds;
+            }
+            rssPeak = std::max(rssPeak, rss);
+            fdsPeak = std::max(fdsPeak, fds);
+            soak.report(now - start, now - lastReport, rss, rssBase, fds);
+            lastReport = now;
+            nextReport += interval;
+        }
+    }
+
+    soak.summary(realSeconds() - start);
+    bool failed = soak.moveFailures > 0 || soak.reconnectFailures > 0;
+    soak.disconnect();
+    if (emulatorPid > 0)
+    {
+        kill(emulatorPid, SIGTERM);
+        waitpid(emulatorPid, nullptr, 0);
+    }
+    removeScratch(home);
+
+    bool grew = fdsBase >= 0 && (rssPeak - rssBase > SOAK_RSS_SLACK || fdsPeak > fdsBase);
+    if (grew)
+        printf("Resources grew during the run: resident memory %+ld kB, file descriptors %+d\n", rssPeak - rssBase,
+               fdsPeak - fdsBase);
+    return (!failed && !grew) ? 0 : 1;
+}
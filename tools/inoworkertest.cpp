@@ -0,0 +1,229 @@
+/*******************************************************************************
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Library General Public
+ License version 2 as published by the Free Software Foundation.
+ .
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Library General Public License for more details.
+ .
+ You should have received a copy of the GNU Library General Public License
+ along with this library; see the file COPYING.LIB.  If not, write to
+ the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ Boston, MA 02110-1301, USA.
+*******************************************************************************/
+
+
+/*
+ * Two roofs sharing the link reactor, one of them with a stalled event loop.
+ * The first roof's stand-in controller sends a stream of events nobody collects, filling its
+ * result queue. The second roof then connects and disconnects repeatedly and has its switches
+ * read, which takes the reactor lock each time. None of it may wait on the stalled roof. Once
+ * its results are collected they must come in the order sent, with the rest counted as dropped.
+ *
+ *   inoworkertest
+ */
+#include "inolink.h"
+#include "inoworker.h"
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <thread>
+#include <unistd.h>
+
+#define TEST_EVENTS 100         // Events sent to the stalled roof
+#define TEST_SESSIONS 20        // Connections of the other roof while the first is stalled
+#define TEST_WAIT 2000          // Milliseconds allowed for anything that should not wait
+
+static std::atomic<bool> running { true };
+
+static bool openPty(int *master, int *slave)
+{
+    struct termios tio;
+
+    *master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (*master < 0 || grantpt(*master) < 0 || unlockpt(*master) < 0)
+        return false;
+    *slave = open(ptsname(*master), O_RDWR | O_NOCTTY);
+    if (*slave < 0)
+        return false;
+    tcgetattr(*slave, &tio);
+    cfmakeraw(&tio);
+    tcsetattr(*slave, TCSANOW, &tio);
+    return true;
+}
+
+static long elapsedMs(const struct timespec &start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+}
+
+// Events numbered in their values so the order they arrive in can be checked
+static void eventController(int fd)
+{
+    char frame[MAXINOBUF];
+
+    for (int i = 0; i < TEST_EVENTS && running; i++)
+    {
+        snprintf(frame, sizeof(frame), "(EVT:OPENED:%d)", i);
+        if (::write(fd, frame, strlen(frame)) < 0)
+            return;
+    }
+}
+
+// Answer switch reads the way the controller firmware does, untagged
+static void readController(int fd)
+{
+    InoFrameBuffer input;
+    char request[MAXINOBUF];
+    const char *response = "(ACK:ALL:0100)";
+
+    while (running)
+    {
+        if (input.fill(fd, 100) < 0)
+            break;
+        while (input.nextFrame(request, sizeof(request)))
+        {
+            if (::write(fd, response, strlen(response)) < 0)
+                return;
+        }
+    }
+}
+
+/*
+ * Run a step on its own thread, failing the test if it does not finish in time. A step stuck
+ * on the reactor lock can not be joined, so the process exits without it.
+ */
+template <typename Step> static bool withinTime(const char *name, Step step)
+{
+    std::atomic<bool> done { false };
+    bool ok = false;
+    struct timespec start;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    std::thread runner([&]() { ok = step(); done = true; });
+    while (!done && elapsedMs(start) < TEST_WAIT)
+        usleep(1000);
+    if (!done)
+    {
+        fprintf(stderr, "FAILED: %s waited on the stalled roof\n", name);
+        _exit(1);
+    }
+    runner.join();
+    if (!ok)
+        fprintf(stderr, "FAILED: %s\n", name);
+    return ok;
+}
+
+static bool readSwitches(InoWorker &worker)
+{
+    InoJob job {};
+    InoResult result;
+    struct pollfd pfd = { worker.notifyFD(), POLLIN, 0 };
+
+    InoWorker::addRequest(&job, "GET", "ALL", "0");
+    if (!worker.post(job, false))
+        return false;
+    while (!worker.next(&result))
+    {
+        if (poll(&pfd, 1, TEST_WAIT) <= 0)
+            return false;
+    }
+    return result.ok[0] && !strcmp(result.responses[0], "(ACK:ALL:0100)");
+}
+
+int main()
+{
+    int stalledMaster, stalledSlave, otherMaster, otherSlave;
+
+    if (!openPty(&stalledMaster, &stalledSlave) || !openPty(&otherMaster, &otherSlave))
+    {
+        perror("pseudo terminal");
+        return 1;
+    }
+
+    InoLink stalledLink, otherLink;
+    InoWorker stalled, other;
+    stalledLink.setDeviceName("stalled");
+    stalledLink.setPort(stalledSlave);
+    otherLink.setDeviceName("other");
+    otherLink.setPort(otherSlave);
+
+    // Kept in the reactor throughout so the other roof's leaving does not stop it
+    if (!stalled.start(&stalledLink))
+    {
+        fprintf(stderr, "Unable to start the link worker\n");
+        return 1;
+    }
+    std::thread events(eventController, stalledMaster);
+    std::thread answers(readController, otherMaster);
+
+    // Until the queue and backlog are full and the rest dropped
+    const unsigned long expectDropped = TEST_EVENTS - INO_QUEUE_SIZE - INO_BACKLOG_SIZE;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (stalled.dropped() < expectDropped && elapsedMs(start) < TEST_WAIT * 5)
+        usleep(1000);
+    events.join();
+
+    int failures = 0;
+    if (stalled.dropped() != expectDropped)
+    {
+        fprintf(stderr, "FAILED: %lu events dropped, expected %lu\n", stalled.dropped(), expectDropped);
+        failures++;
+    }
+
+    for (int session = 0; session < TEST_SESSIONS; session++)
+    {
+        if (!withinTime("connect", [&]() { return other.start(&otherLink); }) ||
+            !withinTime("switch read", [&]() { return readSwitches(other); }) ||
+            !withinTime("disconnect", [&]() { other.stop(); return true; }))
+        {
+            failures++;
+            break;
+        }
+    }
+
+    // Collected late, the kept back results follow the queued ones without a gap
+    InoResult result;
+    struct pollfd pfd = { stalled.notifyFD(), POLLIN, 0 };
+    int received = 0;
+    while (poll(&pfd, 1, 500) > 0)
+    {
+        while (stalled.next(&result))
+        {
+            int value = -1;
+            sscanf(result.responses[0], "(EVT:OPENED:%d)", &value);
+            if (result.tag != INO_RESULT_EVENT || value != received)
+            {
+                fprintf(stderr, "FAILED: event %d came as %s\n", received, result.responses[0]);
+                failures++;
+            }
+            received++;
+        }
+    }
+    if (received != INO_QUEUE_SIZE + INO_BACKLOG_SIZE)
+    {
+        fprintf(stderr, "FAILED: %d events collected, expected %d\n", received, INO_QUEUE_SIZE + INO_BACKLOG_SIZE);
+        failures++;
+    }
+    printf("%d sessions of the other roof, %d events collected, %lu dropped\n", TEST_SESSIONS, received, stalled.dropped());
+
+    stalled.stop();
+    running = false;
+    answers.join();
+    close(stalledSlave);
+    close(stalledMaster);
+    close(otherSlave);
+    close(otherMaster);
+    return failures == 0 ? 0 : 1;
+}